@@ -0,0 +1,87 @@
+# Figures out where hash_set is defined, and then writes out the
+# location to the file specified in $1.  The output file also
+# #defines the namespace that hash_set is in HASH_NAMESPACE.
+#
+# You can use this *instead of* stl_hash.ac.  stl_hash.ac will
+# also define HASH_NAMESPACE, and vars indicating where hash_set
+# lives, but won't actually make an include file for you.  This
+# routine is a higher-level wrapper around hash_set.
+
+AC_DEFUN([AC_CXX_MAKE_HASH_SET_H],
+  [AC_REQUIRE([AC_CXX_STL_HASH])
+   AC_MSG_CHECKING(writing an include-helper for hash_set)
+
+   AS_MKDIR_P([`AS_DIRNAME([$1])`])
+   cat >$1 <<EOF
+#include $ac_cv_cxx_hash_set
+#ifndef HASH_NAMESPACE
+#define HASH_NAMESPACE $ac_cv_cxx_hash_namespace
+#endif
+EOF
+
+   AC_MSG_RESULT([$1])
+])
+
+# We check two things: where the include file is for hash_map, and
+# what namespace hash_map lives in within that include file.  We
+# include AC_TRY_COMPILE for all the combinations we've seen in the
+# wild.  We define one of HAVE_HASH_MAP or HAVE_EXT_HASH_MAP depending
+# on location, and HASH_NAMESPACE to be the namespace hash_map is
+# defined in.  If we can't find a hash_map that works, we die!
+
+AC_DEFUN([AC_CXX_STL_HASH],
+  [AC_CACHE_CHECK(
+      location of STL hash_map,
+      ac_cv_cxx_stl_hash,
+      [AC_REQUIRE([AC_CXX_NAMESPACES])
+      AC_LANG_SAVE
+      AC_LANG_CPLUSPLUS
+      AC_TRY_COMPILE([#include <hash_map>],
+                     [hash_map<int, int> t; return 0;],
+                     ac_cv_cxx_stl_hash=hash_map)
+      AC_TRY_COMPILE([#include <ext/hash_map>],
+                     [__gnu_cxx::hash_map<int, int> t; return 0;],
+                     ac_cv_cxx_stl_hash=ext_hash_map)
+      AC_TRY_COMPILE([#include <hash_map>],
+                     [std::hash_map<int, int> t; return 0;],
+                     ac_cv_cxx_stl_hash=std_hash_map)
+      AC_TRY_COMPILE([#include <hash_map>],
+                     [stdext::hash_map<int, int> t; return 0;],
+                     ac_cv_cxx_stl_hash=stdext_hash_map)
+
+      AC_LANG_RESTORE])
+   if test "$ac_cv_cxx_stl_hash" = hash_map; then
+      AC_DEFINE(HAVE_HASH_MAP, 1, [define if the compiler has hash_map])
+      AC_DEFINE(HAVE_HASH_SET, 1, [define if the compiler has hash_set])
+      ac_cv_cxx_hash_map="<hash_map>"
+      ac_cv_cxx_hash_set="<hash_set>"
+      ac_cv_cxx_hash_namespace=""
+   fi
+   if test "$ac_cv_cxx_stl_hash" = ext_hash_map; then
+      AC_DEFINE(HAVE_EXT_HASH_MAP, 1, [define if the compiler has hash_map])
+      AC_DEFINE(HAVE_EXT_HASH_SET, 1, [define if the compiler has hash_set])
+      ac_cv_cxx_hash_map="<ext/hash_map>"
+      ac_cv_cxx_hash_set="<ext/hash_set>"
+      ac_cv_cxx_hash_namespace="__gnu_cxx"
+   fi
+   if test "$ac_cv_cxx_stl_hash" = std_hash_map; then
+      AC_DEFINE(HAVE_HASH_MAP, 1, [define if the compiler has hash_map])
+      AC_DEFINE(HAVE_HASH_SET, 1, [define if the compiler has hash_set])
+      ac_cv_cxx_hash_map="<hash_map>"
+      ac_cv_cxx_hash_set="<hash_set>"
+      ac_cv_cxx_hash_namespace="std"
+   fi
+   if test "$ac_cv_cxx_stl_hash" = stdext_hash_map; then
+      AC_DEFINE(HAVE_HASH_MAP, 1, [define if the compiler has hash_map])
+      AC_DEFINE(HAVE_HASH_SET, 1, [define if the compiler has hash_set])
+      ac_cv_cxx_hash_map="<hash_map>"
+      ac_cv_cxx_hash_set="<hash_set>"
+      ac_cv_cxx_hash_namespace="stdext"
+   fi
+   AC_DEFINE_UNQUOTED(HASH_NAMESPACE,$ac_cv_cxx_hash_namespace,
+                      [the namespace of hash_map])
+
+   if test x"$ac_cv_cxx_stl_hash" = x; then
+      AC_MSG_ERROR(couldn't find an STL hash_map)
+   fi
+])
@@ -44,6 +44,34 @@
 
 static const int kMallocHistogramSize = 64;
 
+// A source of memory from the operating system.  The malloc
+// implementation calls the installed allocator (see
+// MallocInterface::SetSystemAllocator() below) whenever it needs more
+// memory; an allocator that cannot satisfy a request may pass it on to
+// the one it replaced.  This way the heap can be backed by, e.g.,
+// hugetlbfs files or a pre-reserved pool, and tests can make
+// allocations fail on purpose.
+class SysAllocator {
+ public:
+  virtual ~SysAllocator() { }
+
+  // Allocate and return "size" bytes of zeroed memory whose address is
+  // a multiple of "alignment", a power of two.  Returns NULL when out
+  // of memory.  Calls are serialized.  Called with locks of the malloc
+  // implementation held, so it must not allocate memory with malloc()
+  // or new.
+  virtual void* Alloc(size_t size, size_t alignment) = 0;
+
+  // Give the memory of "[start, start+length)", whole system pages the
+  // malloc implementation no longer needs, back to the system.  It
+  // stays allocated and reads as zeros when touched again.  Returns
+  // false to leave it to the malloc implementation, which then tells
+  // the system the contents are not needed; that frees nothing in
+  // memory mapped shared from a file.  Calls are serialized with those
+  // of Alloc(), under the same restrictions.
+  virtual bool Release(void* /*start*/, size_t /*length*/) { return false; }
+};
+
 // The default implementations of the following routines do nothing.
 class MallocInterface {
  public:
@@ -63,6 +91,22 @@ class MallocInterface {
   // REQUIRES: buffer_length > 0.
   virtual void GetStats(char* buffer, int buffer_length);
 
+  // Get the fragmentation report that MALLOCSTATS=3 prints at exit:
+  // per size class, how full the central cache spans are and the bytes
+  // lost to rounding up to the class, and per page heap partition, the
+  // free spans by length.  Stored like GetStats() above.
+  // REQUIRES: buffer_length > 0.
+  virtual void GetFragmentationReport(char* buffer, int buffer_length);
+
+  // Get the histogram of requested allocation sizes recorded while
+  // "tcmalloc.size_histogram" was set, as text: one "size count bytes"
+  // line per bucket, followed for small sizes by the bytes lost to
+  // rounding up to the size class and the class.  "size_class_gen
+  // --histogram" reads this format.  The histogram is stored as a
+  // null-terminated string in a prefix of "buffer[0,buffer_length-1]".
+  // REQUIRES: buffer_length > 0.
+  virtual void GetSizeHistogram(char* buffer, int buffer_length);
+
   // Get a string that contains a sample of live objects and the stack
   // traces that allocated these objects.  The format of the returned
   // string is equivalent to the output of the heap profiler and can
@@ -93,18 +137,158 @@ class MallocInterface {
   // --------
   // "tcmalloc.max_total_thread_cache_bytes"
   //      Upper limit on total number of bytes stored across all
-  //      per-thread caches.  Default: 16MB.
+  //      per-thread caches, including their cached page-level spans.
+  //      Default: 16MB.
   // 
   // "tcmalloc.current_total_thread_cache_bytes"
   //      Number of bytes used across all thread caches.
   //      This property is not writable.
   //
+  // "tcmalloc.current_total_thread_span_cache_bytes"
+  //      Number of bytes in freed page-level allocations (larger
+  //      than 32KB) that are cached per thread for reuse.
+  //      This property is not writable.
+  //
   // "tcmalloc.slack_bytes"
   //      Number of bytes allocated from system, but not currently
   //      in use by malloced objects.  I.e., bytes available for
   //      allocation without needing more bytes from system.
   //      This property is not writable.
   //
+  // "tcmalloc.numa_partitions"
+  //      Number of page heap partitions that page-level allocations
+  //      are spread across.  Each partition prefers the memory of one
+  //      NUMA node.  Default: 1, or the number of NUMA nodes if the
+  //      TCMALLOC_NUMA_AWARE environment variable is set to non-zero.
+  //
+  // "tcmalloc.pageheap_shards"
+  //      Number of shards, each with its own lock, that the page heap
+  //      partition of every node is split into.  Threads pick a shard
+  //      by cpu.  At most 8.  Default: 1, or the value of the
+  //      TCMALLOC_PAGEHEAP_SHARDS environment variable.
+  //
+  // "tcmalloc.address_ordered_allocation"
+  //      If non-zero, page-level allocations use the lowest-addressed
+  //      free span that is large enough, which keeps the top of the
+  //      heap free.  Default: 0, or 1 if the TCMALLOC_ADDRESS_ORDERED
+  //      environment variable is set to non-zero.
+  //
+  // "tcmalloc.deferred_coalescing"
+  //      If non-zero, freed page-level spans are not merged with their
+  //      neighbors right away, so that allocations of the same length
+  //      can take them back cheaply.  They are merged when memory is
+  //      needed and periodically.  Default: 0, or 1 if the
+  //      TCMALLOC_DEFERRED_COALESCING environment variable is set to
+  //      non-zero.
+  //
+  // "tcmalloc.release_span_pages"
+  //      If non-zero, pages inside the spans of the central cache that
+  //      hold only free objects are given back to the system.
+  //      Default: 0, or 1 if the TCMALLOC_RELEASE_SPAN_PAGES
+  //      environment variable is set to non-zero.
+  //
+  // "tcmalloc.adaptive_span_pages"
+  //      If non-zero, size classes that keep fetching spans from the
+  //      page heap without giving any back fetch bigger spans (up to
+  //      16 times the default, and at most 256KB), and go back to
+  //      smaller ones as their spans are given back.
+  //      Default: 0, or 1 if the TCMALLOC_ADAPTIVE_SPAN_PAGES
+  //      environment variable is set to non-zero.
+  //
+  // "tcmalloc.span_released_bytes"
+  //      Number of bytes currently given back to the system from
+  //      inside central cache spans.
+  //      This property is not writable.
+  //
+  // "tcmalloc.pageheap_top_free_bytes"
+  //      Number of free bytes at the top of the page heap, i.e., in
+  //      free spans that end at the highest address obtained from the
+  //      system.  This is the memory that shrinking the heap could
+  //      give back.
+  //      This property is not writable.
+  //
+  // "tcmalloc.pagemap_bytes"
+  //      Number of bytes of metadata held by the pagemap.  Parts of
+  //      the pagemap that only cover the inside of big free spans are
+  //      given back, together with the memory of those spans.
+  //      This property is not writable.
+  //
+  // "tcmalloc.size_classes"
+  //      Number of size classes small objects are rounded up to.
+  //      The classes can be replaced at startup by a list of sizes in
+  //      the TCMALLOC_SIZE_CLASSES environment variable, or in the file
+  //      named by TCMALLOC_SIZE_CLASSES_FILE; size_class_gen makes such
+  //      a list from an allocation size histogram.
+  //      This property is not writable.
+  //
+  // "tcmalloc.size_histogram"
+  //      If non-zero, every thread counts the sizes it allocates in a
+  //      histogram of its own (see GetSizeHistogram() above).  Setting
+  //      it to non-zero after it was zero starts a new histogram.
+  //      Default: 0, or 1 if the TCMALLOC_SIZE_HISTOGRAM environment
+  //      variable is set to non-zero.
+  //
+  // "tcmalloc.heap_huge_pages"
+  // "tcmalloc.metadata_huge_pages"
+  //      Transparent huge page advice given to the kernel for memory
+  //      the heap, or the allocator's metadata, grows by from now on:
+  //      0 gives no advice and leaves it to the system setting, 1
+  //      asks for huge pages (MADV_HUGEPAGE), 2 asks for none
+  //      (MADV_NOHUGEPAGE).  Default: 0, or the value of the
+  //      TCMALLOC_HEAP_HUGE_PAGES or TCMALLOC_METADATA_HUGE_PAGES
+  //      environment variable.
+  //
+  // "tcmalloc.huge_page_bytes"
+  // "tcmalloc.no_huge_page_bytes"
+  //      Number of bytes the kernel took the advice to use, or not to
+  //      use, huge pages for.
+  //      These properties are not writable.
+  //
+  // "tcmalloc.heap_soft_limit"
+  //      Number of bytes the heap may get from the system, less those
+  //      it gave back, before it tries to make room first: free memory
+  //      of the page heap is given back to the system until the growth
+  //      fits, and if that is not enough, thread caches are flushed
+  //      (those of other threads the next time they refill or
+  //      overflow) and more is given back.  The heap still grows if
+  //      that did not help.  0 means no limit.  Default: 0, or the
+  //      TCMALLOC_HEAP_SOFT_LIMIT_MB environment variable times 1MB.
+  //
+  // "tcmalloc.heap_hard_limit"
+  //      Number of bytes the heap may get from the system at most.
+  //      Allocations that would need more fail, and operator new calls
+  //      the new_handler.  0 means no limit.  Default: 0, or the
+  //      TCMALLOC_HEAP_HARD_LIMIT_MB environment variable times 1MB.
+  //
+  // "tcmalloc.soft_limit_hits"
+  // "tcmalloc.hard_limit_hits"
+  //      Number of times the heap made room before growing past the
+  //      soft limit, and was kept from growing by the hard limit.
+  //      These properties are not writable.
+  //
+  // "tcmalloc.pageheap_deferred_bytes"
+  //      Number of bytes of free page heap memory in spans whose
+  //      coalescing is deferred (see "tcmalloc.deferred_coalescing").
+  //      This property is not writable.
+  //
+  // "tcmalloc.pageheap_released_bytes"
+  //      Number of bytes of free page heap memory that were given back
+  //      to the system and not used again since.  They do not count
+  //      against the soft limit.
+  //      This property is not writable.
+  //
+  // "tcmalloc.page_size"
+  //      Size of the pages that page-level allocations are rounded up
+  //      to, chosen when the library was built.
+  //      This property is not writable.
+  //
+  // "tcmalloc.pageheap_trace"
+  //      If non-zero, page heap operations are recorded in a ring
+  //      buffer that holds the most recent 65536 events (see
+  //      DumpPageHeapTrace() below).  Default: 0, or 1 if the
+  //      TCMALLOC_PAGEHEAP_TRACE environment variable is set to
+  //      non-zero.
+  //
   // TODO: Add more properties as necessary
   // -------------------------------------------------------------------
 
@@ -121,6 +305,47 @@ class MallocInterface {
   // REQUIRES: property != NULL
   virtual bool SetNumericProperty(const char* property, size_t value);
 
+  // Write the events recorded while "tcmalloc.pageheap_trace" was
+  // enabled, oldest first, as text to "filename".  The file can be
+  // analyzed with "pageheap-trace".  Returns false if nothing was
+  // recorded, the file cannot be written, or the malloc
+  // implementation does not support tracing.
+  // REQUIRES: filename != NULL
+  virtual bool DumpPageHeapTrace(const char* filename);
+
+  // Make sure the heap has "bytes" of free memory, growing it if
+  // necessary, and have the system back that memory now, so that the
+  // first allocations after startup do not take page faults.  The
+  // memory is taken from the heap partition of the calling thread.
+  // Returns false if the memory cannot be obtained or the malloc
+  // implementation does not support prefaulting.
+  virtual bool PrefaultHeap(size_t bytes);
+
+  // Fill the central cache with at least "objects" free objects of
+  // the size class that "size" bytes are rounded up to, so that the
+  // first allocations of that size neither take page faults nor go to
+  // the page heap.  The implementation may cap "objects" at the number
+  // a thread cache keeps for one class.  Returns false if "size" is not served from size classes, memory
+  // runs out, or the malloc implementation does not support this.
+  virtual bool PopulateSizeClass(size_t size, int objects);
+
+  // Give the free memory of the heap back to the system.  It stays
+  // part of the heap and is taken back when allocations need it.
+  // Memory in thread and central caches is not affected.
+  virtual void ReleaseFreeMemory();
+
+  // Get the allocator memory is currently taken from the system with.
+  // Returns NULL if the malloc implementation does not support
+  // replacing it.
+  virtual SysAllocator* GetSystemAllocator();
+
+  // Take memory from the system with "allocator" from now on.  Memory
+  // obtained before is kept.  To chain allocators, get the current one
+  // first and call it from the new one.  Returns false if the malloc
+  // implementation does not support replacing the allocator.
+  // REQUIRES: allocator != NULL and lives until the program exits
+  virtual bool SetSystemAllocator(SysAllocator* allocator);
+
   // The current malloc implementation.  Always non-NULL.
   static MallocInterface* instance();
 
@@ -63,11 +63,44 @@ bool MallocInterface::SetNumericProperty(const char* property, size_t value) {
   return false;
 }
 
+bool MallocInterface::DumpPageHeapTrace(const char* filename) {
+  return false;
+}
+
+bool MallocInterface::PrefaultHeap(size_t bytes) {
+  return false;
+}
+
+bool MallocInterface::PopulateSizeClass(size_t size, int objects) {
+  return false;
+}
+
+void MallocInterface::ReleaseFreeMemory() {
+}
+
+SysAllocator* MallocInterface::GetSystemAllocator() {
+  return NULL;
+}
+
+bool MallocInterface::SetSystemAllocator(SysAllocator* allocator) {
+  return false;
+}
+
 void MallocInterface::GetStats(char* buffer, int length) {
   assert(length > 0);
   buffer[0] = '\0';
 }
 
+void MallocInterface::GetFragmentationReport(char* buffer, int length) {
+  assert(length > 0);
+  buffer[0] = '\0';
+}
+
+void MallocInterface::GetSizeHistogram(char* buffer, int length) {
+  assert(length > 0);
+  buffer[0] = '\0';
+}
+
 bool MallocInterface::MallocMemoryStats(int* blocks, size_t* total,
                                        int histogram[kMallocHistogramSize]) {
   *blocks = 0;
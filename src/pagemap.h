@@ -31,12 +31,31 @@
 // Author: Sanjay Ghemawat <opensource@google.com>
 //
 // A data structure used by the caching malloc.  It maps from page# to
-// a pointer that contains info about that page.  We use two
-// representations: one for 32-bit addresses, and another for 64 bit
-// addresses.  Both representations provide the same interface.  The
-// first representation is implemented as a flat array, the seconds as
-// a three-level radix tree that strips away approximately 1/3rd of
-// the bits every time.
+// a pointer that contains info about that page.  There are several
+// representations with the same interface:
+//   PageMap1:    a flat array, for 32-bit addresses
+//   PageMapFlat: a flat array in reserved address space that is only
+//                committed where pages are in use, for 64-bit machines
+//                whose user addresses fit in 48 bits
+//   PageMap2:    a two-level radix tree with a large root in reserved
+//                address space, for the same machines
+//   PageMap3:    a three-level radix tree that strips away
+//                approximately 1/3rd of the bits every time, for any
+//                address size
+// A lookup takes one, one, two and three dependent loads respectively.
+//
+// Besides the pointer, every page has a small integer (the size class
+// of the objects on that page) that is kept in a separate byte array so
+// that it can be looked up without touching the pointed-to object, and
+// so that the values for many neighboring pages share a cache line.
+//
+// Entries are only valid for pages that have been passed to Ensure().
+// The maps that are allocated piecemeal can also give back the memory
+// for ranges of pages whose entries are no longer needed (Release()).
+// Lock-free readers must still be able to look at such a page, so a
+// released part of a radix tree is replaced by a shared node that reads
+// as all zeros rather than by NULL, and the memory of a released node is
+// kept for reuse instead of being unmapped.
 //
 // The BITS parameter should be the number of bits required to hold
 // a page number.  E.g., with 32 bit pointers and 4K pages (i.e.,
@@ -54,19 +73,26 @@
 #include <sys/types.h>
 #endif
 #include "internal_logging.h"
+#include "system-alloc.h"
 
 // Single-level array
 template <int BITS>
 class TCMalloc_PageMap1 {
  private:
   void** array_;
+  unsigned char* classes_;
 
  public:
   typedef uintptr_t Number;
 
+  // Release() never gives anything back
+  static const size_t RELEASE_LENGTH = 0;
+
   explicit TCMalloc_PageMap1(void* (*allocator)(size_t)) {
     array_ = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
     memset(array_, 0, sizeof(void*) << BITS);
+    classes_ = reinterpret_cast<unsigned char*>((*allocator)(1 << BITS));
+    memset(classes_, 0, 1 << BITS);
   }
 
   // Ensure that the map contains initialized entries "x .. x+n-1".
@@ -76,6 +102,21 @@ class TCMalloc_PageMap1 {
     return true;
   }
 
+  // Give back the memory for entries "start .. start+n-1", which are no
+  // longer needed, in units of RELEASE_LENGTH aligned pages.  Sets
+  // "[*lo, *hi)" to the pages whose units lie inside the range.
+  // Returns true if any of them held memory.  The entries must be
+  // passed to Ensure() again before they are set.
+  bool Release(Number start, size_t n, Number* lo, Number* hi) {
+    *lo = *hi = start;
+    return false;
+  }
+
+  // Return the number of bytes of memory held by the map
+  size_t bytes() const {
+    return (sizeof(void*) + 1) << BITS;
+  }
+
   // REQUIRES "k" is in range "[0,2^BITS-1]".
   // REQUIRES "k" has been ensured before.
   //
@@ -92,6 +133,255 @@ class TCMalloc_PageMap1 {
   void set(Number k, void* v) {
     array_[k] = v;
   }
+
+  // REQUIRES "k" is in range "[0,2^BITS-1]".
+  // REQUIRES "k" has been ensured before.
+  //
+  // Return the size class for KEY.  Returns 0 if not yet set.
+  int sizeclass(Number k) const {
+    return classes_[k];
+  }
+
+  // REQUIRES "k" is in range "[0,2^BITS-1]".
+  // REQUIRES "k" has been ensured before.
+  // REQUIRES "0 <= v < 256".
+  //
+  // Sets the size class for KEY.
+  void set_sizeclass(Number k, int v) {
+    classes_[k] = v;
+  }
+};
+
+// Single-level array in reserved address space.  The array covers
+// every possible page number but memory is only committed for the
+// parts that Ensure() is called on.
+template <int BITS>
+class TCMalloc_PageMapFlat {
+ private:
+  // Memory is committed and released in chunks of 2^CHUNK_BITS pages
+  static const int CHUNK_BITS = 12;
+  static const size_t CHUNK_LENGTH = static_cast<size_t>(1) << CHUNK_BITS;
+
+  void** array_;
+  unsigned char* classes_;
+  unsigned char* committed_;            // One flag per chunk
+  size_t bytes_;                        // Memory in committed chunks
+
+ public:
+  typedef uintptr_t Number;
+
+  static const size_t RELEASE_LENGTH = CHUNK_LENGTH;
+
+  explicit TCMalloc_PageMapFlat(void* (*allocator)(size_t)) {
+    const size_t chunks = static_cast<size_t>(1) << (BITS - CHUNK_BITS);
+    array_ = reinterpret_cast<void**>(
+        TCMalloc_SystemReserve(sizeof(void*) << BITS));
+    classes_ = reinterpret_cast<unsigned char*>(
+        TCMalloc_SystemReserve(static_cast<size_t>(1) << BITS));
+    committed_ = reinterpret_cast<unsigned char*>(
+        TCMalloc_SystemReserve(chunks));
+    if (committed_ != NULL && !TCMalloc_SystemCommit(committed_, chunks)) {
+      committed_ = NULL;
+    }
+    if (array_ == NULL || classes_ == NULL || committed_ == NULL) {
+      MESSAGE("Could not reserve address space for the page map\n");
+    }
+    bytes_ = 0;
+  }
+
+  bool Ensure(Number x, size_t n) {
+    if (array_ == NULL || classes_ == NULL || committed_ == NULL) {
+      return false;
+    }
+    for (Number c = x >> CHUNK_BITS; c <= (x + n - 1) >> CHUNK_BITS; c++) {
+      if (committed_[c]) continue;
+      const Number first = c << CHUNK_BITS;
+      if (!TCMalloc_SystemCommit(&array_[first],
+                                 CHUNK_LENGTH * sizeof(void*)) ||
+          !TCMalloc_SystemCommit(&classes_[first], CHUNK_LENGTH)) {
+        return false;
+      }
+      committed_[c] = 1;
+      bytes_ += CHUNK_LENGTH * (sizeof(void*) + 1);
+    }
+    return true;
+  }
+
+  // Released chunks stay committed but read as zeros
+  bool Release(Number start, size_t n, Number* lo, Number* hi) {
+    const Number first = (start + CHUNK_LENGTH - 1) >> CHUNK_BITS;
+    const Number limit = (start + n) >> CHUNK_BITS;
+    bool released = false;
+    *lo = *hi = start;
+    if (first >= limit || committed_ == NULL) return false;
+    for (Number c = first; c < limit; c++) {
+      if (!committed_[c]) continue;
+      const Number page = c << CHUNK_BITS;
+      TCMalloc_SystemRelease(&array_[page], CHUNK_LENGTH * sizeof(void*));
+      TCMalloc_SystemRelease(&classes_[page], CHUNK_LENGTH);
+      committed_[c] = 0;
+      bytes_ -= CHUNK_LENGTH * (sizeof(void*) + 1);
+      released = true;
+    }
+    *lo = first << CHUNK_BITS;
+    *hi = limit << CHUNK_BITS;
+    return released;
+  }
+
+  size_t bytes() const {
+    return bytes_;
+  }
+
+  void* get(Number k) const {
+    ASSERT(k >> BITS == 0);
+    return array_[k];
+  }
+
+  void set(Number k, void* v) {
+    ASSERT(k >> BITS == 0);
+    array_[k] = v;
+  }
+
+  int sizeclass(Number k) const {
+    ASSERT(k >> BITS == 0);
+    return classes_[k];
+  }
+
+  void set_sizeclass(Number k, int v) {
+    ASSERT(k >> BITS == 0);
+    classes_[k] = v;
+  }
+};
+
+// Two-level radix tree.  The root has an entry for every 2^LEAF_BITS
+// pages.  It is too big to allocate outright, so it lives in reserved
+// address space and only the parts that point to leaves get touched.
+template <int BITS>
+class TCMalloc_PageMap2 {
+ private:
+  // How many bits should we consume at the leaf level
+  static const int LEAF_BITS = 15;
+  static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+  // How many bits the root consumes
+  static const int ROOT_BITS = BITS - LEAF_BITS;
+  static const int ROOT_LENGTH = 1 << ROOT_BITS;
+
+  // Leaf node
+  struct Leaf {
+    void* values[LEAF_LENGTH];
+    unsigned char classes[LEAF_LENGTH];
+  };
+
+  Leaf** root_;                         // Root of radix tree
+  void* (*allocator_)(size_t);          // Memory allocator
+  Leaf* empty_;                         // Stands in for released leaves
+  Leaf* free_leaves_;                   // Released leaves, for reuse
+  size_t leaves_;                       // Leaves in use
+
+  Leaf* NewLeaf() {
+    Leaf* leaf = free_leaves_;
+    if (leaf != NULL) {
+      free_leaves_ = reinterpret_cast<Leaf*>(leaf->values[0]);
+    } else {
+      leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+      if (leaf == NULL) return NULL;
+    }
+    memset(leaf, 0, sizeof(*leaf));
+    leaves_++;
+    return leaf;
+  }
+
+ public:
+  typedef uintptr_t Number;
+
+  static const size_t RELEASE_LENGTH = LEAF_LENGTH;
+
+  explicit TCMalloc_PageMap2(void* (*allocator)(size_t)) {
+    allocator_ = allocator;
+    free_leaves_ = NULL;
+    leaves_ = 0;
+    const size_t bytes = sizeof(Leaf*) * ROOT_LENGTH;
+    root_ = reinterpret_cast<Leaf**>(TCMalloc_SystemReserve(bytes));
+    if (root_ == NULL || !TCMalloc_SystemCommit(root_, bytes)) {
+      // Fall back to memory that is used right away
+      root_ = reinterpret_cast<Leaf**>((*allocator_)(bytes));
+      if (root_ != NULL) memset(root_, 0, bytes);
+    }
+    // Never written, so it takes no memory until somebody reads it.
+    // Without it, leaves are never released.
+    empty_ = reinterpret_cast<Leaf*>(TCMalloc_SystemReserve(sizeof(Leaf)));
+    if (empty_ != NULL && !TCMalloc_SystemCommit(empty_, sizeof(Leaf))) {
+      empty_ = NULL;
+    }
+  }
+
+  void* get(Number k) const {
+    ASSERT(k >> BITS == 0);
+    return root_[k >> LEAF_BITS]->values[k & (LEAF_LENGTH-1)];
+  }
+
+  void set(Number k, void* v) {
+    ASSERT(k >> BITS == 0);
+    ASSERT(root_[k >> LEAF_BITS] != empty_);
+    root_[k >> LEAF_BITS]->values[k & (LEAF_LENGTH-1)] = v;
+  }
+
+  int sizeclass(Number k) const {
+    ASSERT(k >> BITS == 0);
+    return root_[k >> LEAF_BITS]->classes[k & (LEAF_LENGTH-1)];
+  }
+
+  void set_sizeclass(Number k, int v) {
+    ASSERT(k >> BITS == 0);
+    ASSERT(root_[k >> LEAF_BITS] != empty_);
+    root_[k >> LEAF_BITS]->classes[k & (LEAF_LENGTH-1)] = v;
+  }
+
+  bool Ensure(Number start, size_t n) {
+    if (root_ == NULL) return false;
+    for (Number key = start; key <= start + n - 1; ) {
+      const Number i1 = key >> LEAF_BITS;
+
+      // Make leaf node if necessary
+      if (root_[i1] == NULL || root_[i1] == empty_) {
+        Leaf* leaf = NewLeaf();
+        if (leaf == NULL) return false;
+        root_[i1] = leaf;
+      }
+
+      // Advance key past whatever is covered by this leaf node
+      key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+    }
+    return true;
+  }
+
+  bool Release(Number start, size_t n, Number* lo, Number* hi) {
+    const Number first = (start + LEAF_LENGTH - 1) >> LEAF_BITS;
+    const Number limit = (start + n) >> LEAF_BITS;
+    bool released = false;
+    *lo = *hi = start;
+    if (first >= limit || root_ == NULL || empty_ == NULL) return false;
+    for (Number i1 = first; i1 < limit; i1++) {
+      Leaf* leaf = root_[i1];
+      if (leaf == NULL || leaf == empty_) continue;
+      root_[i1] = empty_;
+      TCMalloc_SystemRelease(leaf, sizeof(*leaf));
+      leaf->values[0] = free_leaves_;
+      free_leaves_ = leaf;
+      leaves_--;
+      released = true;
+    }
+    *lo = first << LEAF_BITS;
+    *hi = limit << LEAF_BITS;
+    return released;
+  }
+
+  // The root is not counted: only the parts of it that are touched
+  // take memory, and they never hold more than a pointer per leaf.
+  size_t bytes() const {
+    return leaves_ * sizeof(Leaf);
+  }
 };
 
 // Three-level radix tree
@@ -114,25 +404,84 @@ class TCMalloc_PageMap3 {
   // Leaf node
   struct Leaf {
     void* values[LEAF_LENGTH];
+    unsigned char classes[LEAF_LENGTH];
   };
 
   Node* root_;                          // Root of radix tree
   void* (*allocator_)(size_t);          // Memory allocator
 
+  // Released 2nd level nodes and leaves are replaced by these.  All
+  // pointers in "empty_node_" point to "empty_leaf_", which is never
+  // written.  If either could not be made, nothing is released.
+  Node* empty_node_;
+  Leaf* empty_leaf_;
+
+  Node* free_nodes_;                    // Released nodes, for reuse
+  Leaf* free_leaves_;                   // Released leaves, for reuse
+  size_t nodes_;                        // Nodes in use, including root
+  size_t leaves_;                       // Leaves in use
+
   Node* NewNode() {
-    Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
+    Node* result = free_nodes_;
     if (result != NULL) {
-      memset(result, 0, sizeof(*result));
+      free_nodes_ = result->ptrs[0];
+    } else {
+      result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
+      if (result == NULL) return NULL;
     }
+    memset(result, 0, sizeof(*result));
+    nodes_++;
     return result;
   }
 
+  Leaf* NewLeaf() {
+    Leaf* leaf = free_leaves_;
+    if (leaf != NULL) {
+      free_leaves_ = reinterpret_cast<Leaf*>(leaf->values[0]);
+    } else {
+      leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+      if (leaf == NULL) return NULL;
+    }
+    memset(leaf, 0, sizeof(*leaf));
+    leaves_++;
+    return leaf;
+  }
+
+  // Is there no leaf left under "node"?
+  bool IsEmpty(const Node* node) const {
+    for (int i2 = 0; i2 < INTERIOR_LENGTH; i2++) {
+      const Leaf* leaf = reinterpret_cast<const Leaf*>(node->ptrs[i2]);
+      if (leaf != NULL && leaf != empty_leaf_) return false;
+    }
+    return true;
+  }
+
  public:
   typedef uintptr_t Number;
 
+  static const size_t RELEASE_LENGTH = LEAF_LENGTH;
+
   explicit TCMalloc_PageMap3(void* (*allocator)(size_t)) {
     allocator_ = allocator;
+    free_nodes_ = NULL;
+    free_leaves_ = NULL;
+    nodes_ = leaves_ = 0;
     root_ = NewNode();
+    empty_leaf_ = reinterpret_cast<Leaf*>(
+        TCMalloc_SystemReserve(sizeof(Leaf)));
+    if (empty_leaf_ != NULL &&
+        !TCMalloc_SystemCommit(empty_leaf_, sizeof(Leaf))) {
+      empty_leaf_ = NULL;
+    }
+    empty_node_ = NULL;
+    if (empty_leaf_ != NULL) {
+      empty_node_ = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
+    }
+    if (empty_node_ != NULL) {
+      for (int i2 = 0; i2 < INTERIOR_LENGTH; i2++) {
+        empty_node_->ptrs[i2] = reinterpret_cast<Node*>(empty_leaf_);
+      }
+    }
   }
 
   void* get(Number k) const {
@@ -148,26 +497,48 @@ class TCMalloc_PageMap3 {
     const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
     const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
     const Number i3 = k & (LEAF_LENGTH-1);
+    ASSERT(root_->ptrs[i1]->ptrs[i2] != reinterpret_cast<Node*>(empty_leaf_));
     reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3] = v;
   }
 
+  int sizeclass(Number k) const {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
+    const Number i3 = k & (LEAF_LENGTH-1);
+    return reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->classes[i3];
+  }
+
+  void set_sizeclass(Number k, int v) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
+    const Number i3 = k & (LEAF_LENGTH-1);
+    ASSERT(root_->ptrs[i1]->ptrs[i2] != reinterpret_cast<Node*>(empty_leaf_));
+    reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->classes[i3] = v;
+  }
+
   bool Ensure(Number start, size_t n) {
     for (Number key = start; key <= start + n - 1; ) {
       const Number i1 = key >> (LEAF_BITS + INTERIOR_BITS);
       const Number i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH-1);
 
-      // Make 2nd level node if necessary
-      if (root_->ptrs[i1] == NULL) {
+      // Make 2nd level node if necessary.  A node that replaces a
+      // released one must read as empty everywhere it is not ensured.
+      if (root_->ptrs[i1] == NULL || root_->ptrs[i1] == empty_node_) {
         Node* n = NewNode();
         if (n == NULL) return false;
+        if (root_->ptrs[i1] == empty_node_) {
+          memcpy(n, empty_node_, sizeof(*n));
+        }
         root_->ptrs[i1] = n;
       }
 
       // Make leaf node if necessary
-      if (root_->ptrs[i1]->ptrs[i2] == NULL) {
-        Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+      Leaf* leaf = reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2]);
+      if (leaf == NULL || leaf == empty_leaf_) {
+        leaf = NewLeaf();
         if (leaf == NULL) return false;
-        memset(leaf, 0, sizeof(*leaf));
         root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
       }
 
@@ -176,6 +547,44 @@ class TCMalloc_PageMap3 {
     }
     return true;
   }
+
+  bool Release(Number start, size_t n, Number* lo, Number* hi) {
+    const Number first = (start + LEAF_LENGTH - 1) >> LEAF_BITS;
+    const Number limit = (start + n) >> LEAF_BITS;
+    bool released = false;
+    *lo = *hi = start;
+    if (first >= limit || empty_node_ == NULL) return false;
+    for (Number l = first; l < limit; l++) {
+      const Number i1 = l >> INTERIOR_BITS;
+      const Number i2 = l & (INTERIOR_LENGTH-1);
+      Node* node = root_->ptrs[i1];
+      if (node == NULL || node == empty_node_) continue;
+      Leaf* leaf = reinterpret_cast<Leaf*>(node->ptrs[i2]);
+      if (leaf != NULL && leaf != empty_leaf_) {
+        node->ptrs[i2] = reinterpret_cast<Node*>(empty_leaf_);
+        TCMalloc_SystemRelease(leaf, sizeof(*leaf));
+        leaf->values[0] = free_leaves_;
+        free_leaves_ = leaf;
+        leaves_--;
+        released = true;
+      }
+      // Give back the node after its last leaf in the range
+      if ((i2 == INTERIOR_LENGTH-1 || l == limit-1) && IsEmpty(node)) {
+        root_->ptrs[i1] = empty_node_;
+        TCMalloc_SystemRelease(node, sizeof(*node));
+        node->ptrs[0] = free_nodes_;
+        free_nodes_ = node;
+        nodes_--;
+      }
+    }
+    *lo = first << LEAF_BITS;
+    *hi = limit << LEAF_BITS;
+    return released;
+  }
+
+  size_t bytes() const {
+    return nodes_ * sizeof(Node) + leaves_ * sizeof(Leaf);
+  }
 };
 
 #endif  // TCMALLOC_PAGEMAP_H__
@@ -0,0 +1,464 @@
+// Copyright (c) 2005, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Generates src/size_classes.h, the tables that map between object
+// sizes and size classes in tcmalloc.  Computing them used to be the
+// first thing every process did; now it is done once, here, and the
+// result is checked in.  Run "make size-classes" after changing any of
+// the parameters below; they must agree with the ones in tcmalloc.cc.
+//
+// Usage: size_class_gen > src/size_classes.h
+//        size_class_gen --histogram file [--classes n] > classes.txt
+//
+// The second form picks size classes for a program whose allocation
+// sizes are known.  "file" has one "size count" pair per line, e.g.
+// the allocation size histogram of a run of the program; sizes bigger
+// than the largest size class are ignored.  The classes are chosen to
+// waste as little memory to rounding up as possible for that
+// histogram, and classes to spare are filled with default ones.  The
+// output can be handed to tcmalloc with TCMALLOC_SIZE_CLASSES_FILE, and
+// the rounding waste of the default and the new table is printed to
+// stderr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t kMaxSize    = 256u << 10;
+static const int kAlignShift    = 3;
+static const size_t kAlignment  = 1 << kAlignShift;
+static const int kNumClasses    = 200;
+
+// Sizes up to kMaxSmallSize are looked up in steps of kAlignment,
+// bigger ones in steps of 2^kLargeSizeShift.  Classes must be
+// multiples of the step of their range.
+static const size_t kMaxSmallSize = 1024;
+static const int kLargeSizeShift = 7;
+
+// Objects moved between a thread cache and the central cache at once
+static const int kNumObjectsToMove = 32;
+static const int kMinObjectsToMove = 2;
+static const size_t kBytesToMove = 64 << 10;
+
+// Page sizes the library may be built with (see TCMALLOC_PAGE_SHIFT)
+static const int kMinPageShift = 12;
+static const int kMaxPageShift = 16;
+
+static size_t class_to_size[kNumClasses];
+static int num_classes;
+
+static int LgFloor(size_t n) {
+  int log = 0;
+  while (n > 1) {
+    n >>= 1;
+    log++;
+  }
+  return log;
+}
+
+// Smallest class that holds "size" bytes
+static int SizeClass(size_t size) {
+  int lo = 1, hi = num_classes - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (class_to_size[mid] >= size) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+// The default classes: eight per power of two, except that the step
+// does not go below 8 bytes and stays at 256 bytes from 2K to 32K.
+static void ComputeSizeClasses() {
+  int next_class = 1;
+  int alignshift = kAlignShift;
+  int last_lg = -1;
+  for (size_t size = kAlignment; size <= kMaxSize; size += (1 << alignshift)) {
+    int lg = LgFloor(size);
+    if (lg > last_lg) {
+      // Increase alignment every so often.
+      //
+      // Since we double the alignment every time size doubles and
+      // size >= 128, this means that space wasted due to alignment is
+      // at most 16/128 i.e., 12.5%.  Plus we cap the alignment at 256
+      // bytes, so the space wasted as a percentage starts falling for
+      // sizes > 2K.  From 32K on, where this would take too many
+      // classes, there are again eight classes per power of two.
+      if ((lg >= 7) && (alignshift < 8)) {
+        alignshift++;
+      }
+      if (lg >= 15) {
+        alignshift = lg - 3;
+      }
+    }
+
+    if (next_class >= kNumClasses - 1) {
+      fprintf(stderr, "used up too many size classes: %d\n", next_class + 1);
+      exit(1);
+    }
+    class_to_size[next_class] = size;
+    last_lg = lg;
+
+    next_class++;
+  }
+  num_classes = next_class;
+}
+
+// Is "size" a multiple of the lookup step of its range?
+static bool IsLookupAligned(size_t size) {
+  if (size <= kMaxSmallSize) return size % kAlignment == 0;
+  return size % (static_cast<size_t>(1) << kLargeSizeShift) == 0;
+}
+
+static int ObjectsToMove(int cl) {
+  int move = kBytesToMove / class_to_size[cl];
+  if (move > kNumObjectsToMove) move = kNumObjectsToMove;
+  if (move < kMinObjectsToMove) move = kMinObjectsToMove;
+  return move;
+}
+
+// Allocate enough pages so leftover is less than 1/8 of total.
+// This bounds wasted space to at most 12.5%.
+static int PagesForClass(int cl, int page_shift) {
+  const size_t page_size = static_cast<size_t>(1) << page_shift;
+  const size_t s = class_to_size[cl];
+  size_t psize = page_size;
+  while ((psize % s) > (psize >> 3)) {
+    psize += page_size;
+  }
+  if (psize / s >= (1 << 15)) {
+    // Would overflow Span::refcount
+    fprintf(stderr, "Too many objects per span for class %d\n", cl);
+    exit(1);
+  }
+  return psize >> page_shift;
+}
+
+// Print "n" values produced by "value(i)" as the body of an array
+static void PrintValues(int n, size_t (*value)(int), int per_line) {
+  for (int i = 0; i < n; i++) {
+    if (i % per_line == 0) printf("  ");
+    printf("%lu,", static_cast<unsigned long>((*value)(i)));
+    printf((i % per_line == per_line - 1 || i == n - 1) ? "\n" : " ");
+  }
+}
+
+static int page_shift;
+static size_t ClassSize(int cl) { return class_to_size[cl]; }
+static size_t ClassMove(int cl) { return cl == 0 ? 0 : ObjectsToMove(cl); }
+static size_t ClassPages(int cl) {
+  return cl == 0 ? 0 : PagesForClass(cl, page_shift);
+}
+static size_t SmallClass(int i) {
+  return SizeClass(i << kAlignShift);
+}
+static size_t LargeClass(int i) {
+  const size_t size = static_cast<size_t>(i) << kLargeSizeShift;
+  return size <= kMaxSmallSize ? 0 : SizeClass(size);
+}
+
+static void PrintTables() {
+  for (int cl = 1; cl < num_classes; cl++) {
+    if (!IsLookupAligned(class_to_size[cl])) {
+      fprintf(stderr, "Class %d (%lu bytes) does not fit the lookup tables\n",
+              cl, static_cast<unsigned long>(class_to_size[cl]));
+      exit(1);
+    }
+  }
+
+  printf("// Generated by size_class_gen; do not edit.\n"
+         "//\n"
+         "// Tables that map between object sizes and size classes,\n"
+         "// included by tcmalloc.cc.  Objects of up to %lu bytes are\n"
+         "// split into %d classes (class 0 is not used).\n"
+         "\n"
+         "#ifndef TCMALLOC_SIZE_CLASSES_H__\n"
+         "#define TCMALLOC_SIZE_CLASSES_H__\n"
+         "\n"
+         "static const size_t kSizeClassesMaxSize = %lu;\n"
+         "static const int kSizeClassesCount = %d;\n"
+         "\n",
+         static_cast<unsigned long>(kMaxSize), num_classes - 1,
+         static_cast<unsigned long>(kMaxSize), num_classes);
+
+  printf("// Size classes of the sizes up to kMaxSmallSize, indexed by\n"
+         "// \"(size + %d) >> %d\"\n"
+         "static const size_t kMaxSmallSize = %lu;\n"
+         "static unsigned char small_size_class[%lu] = {\n",
+         int(kAlignment - 1), kAlignShift,
+         static_cast<unsigned long>(kMaxSmallSize),
+         static_cast<unsigned long>((kMaxSmallSize >> kAlignShift) + 1));
+  PrintValues((kMaxSmallSize >> kAlignShift) + 1, SmallClass, 16);
+  printf("};\n\n");
+
+  printf("// Size classes of the bigger sizes, indexed by\n"
+         "// \"(size + %d) >> kLargeSizeShift\"\n"
+         "static const int kLargeSizeShift = %d;\n"
+         "static unsigned char large_size_class[%lu] = {\n",
+         (1 << kLargeSizeShift) - 1, kLargeSizeShift,
+         static_cast<unsigned long>((kMaxSize >> kLargeSizeShift) + 1));
+  PrintValues((kMaxSize >> kLargeSizeShift) + 1, LargeClass, 16);
+  printf("};\n\n");
+
+  printf("// Mapping from size class to size\n"
+         "static size_t class_to_size[kNumClasses] = {\n");
+  PrintValues(num_classes, ClassSize, 8);
+  printf("};\n\n");
+
+  printf("// Mapping from size class to number of objects to move between\n"
+         "// a thread cache and the central cache at a time\n"
+         "static int class_to_move[kNumClasses] = {\n");
+  PrintValues(num_classes, ClassMove, 16);
+  printf("};\n\n");
+
+  printf("// Mapping from size class to number of pages to allocate at a\n"
+         "// time, for each page size\n");
+  for (page_shift = kMinPageShift; page_shift <= kMaxPageShift; page_shift++) {
+    printf("#%s TCMALLOC_PAGE_SHIFT == %d\n",
+           page_shift == kMinPageShift ? "if" : "elif", page_shift);
+    printf("static size_t class_to_pages[kNumClasses] = {\n");
+    PrintValues(num_classes, ClassPages, 16);
+    printf("};\n");
+  }
+  printf("#else\n"
+         "#error \"No size class tables for this TCMALLOC_PAGE_SHIFT\"\n"
+         "#endif\n"
+         "\n"
+         "#endif  // TCMALLOC_SIZE_CLASSES_H__\n");
+}
+
+// -------------------------------------------------------------------
+// Classes for a histogram.  Every possible class size is a point on a
+// grid: the multiples of kAlignment up to kMaxSmallSize, then the
+// multiples of 2^kLargeSizeShift.  An allocation of "size" bytes is
+// counted at the first grid point >= size.
+// -------------------------------------------------------------------
+
+static const int kSmallPoints = kMaxSmallSize >> kAlignShift;
+static const int kGridPoints =
+    kSmallPoints + ((kMaxSize - kMaxSmallSize) >> kLargeSizeShift);
+
+static size_t GridSize(int g) {
+  if (g < kSmallPoints) return (g + 1) << kAlignShift;
+  return kMaxSmallSize + ((g - kSmallPoints + 1) << kLargeSizeShift);
+}
+
+static int GridPoint(size_t size) {
+  if (size <= kAlignment) return 0;
+  if (size <= kMaxSmallSize) return (size + kAlignment - 1) / kAlignment - 1;
+  const size_t step = static_cast<size_t>(1) << kLargeSizeShift;
+  return kSmallPoints + (size - kMaxSmallSize + step - 1) / step - 1;
+}
+
+static double grid_count[kGridPoints];  // Allocations at each point
+static bool selected[kGridPoints];      // Is the point a class?
+
+// Bytes handed out for all counted allocations with the selected classes
+static double HandedOut() {
+  double total = 0;
+  double pending = 0;             // Allocations waiting for a class
+  for (int g = 0; g < kGridPoints; g++) {
+    pending += grid_count[g];
+    if (selected[g]) {
+      total += pending * GridSize(g);
+      pending = 0;
+    }
+  }
+  return total;
+}
+
+// Select the "max_classes" classes that hand out the fewest bytes for
+// the histogram.  Only points with allocations (and the biggest size,
+// which must always be a class) are worth a class; among those the best
+// choice is found by dynamic programming over (classes, last point).
+// Classes left over go to default classes, so that sizes missing from
+// the histogram are not rounded up too far.
+static void OptimizeClasses(int max_classes) {
+  static int point[kGridPoints];        // Grid points that are candidates
+  static double below[kGridPoints + 1]; // Allocations before each candidate
+  int k = 0;
+  for (int g = 0; g < kGridPoints; g++) {
+    if (grid_count[g] > 0 || g == kGridPoints - 1) {
+      below[k + 1] = below[k] + grid_count[g];
+      point[k++] = g;
+    }
+  }
+  const int n = (max_classes < k) ? max_classes : k;
+
+  // best[c][j]: fewest bytes for the allocations up to candidate j with
+  // "c+1" classes, the last one at candidate j; from[c][j]: the
+  // candidate after the previous class.
+  double* best = new double[n * k];
+  int* from = new int[n * k];
+  for (int c = 0; c < n; c++) {
+    for (int j = c; j < k; j++) {
+      const double size = GridSize(point[j]);
+      double b = -1;
+      int f = 0;
+      if (c == 0) {
+        b = size * below[j + 1];
+      } else {
+        for (int i = c; i <= j; i++) {
+          const double t = best[(c-1) * k + i - 1] +
+                           size * (below[j + 1] - below[i]);
+          if (b < 0 || t < b) {
+            b = t;
+            f = i;
+          }
+        }
+      }
+      best[c * k + j] = b;
+      from[c * k + j] = f;
+    }
+  }
+
+  // Replace the default classes with the chosen ones
+  bool defaults[kGridPoints];
+  memcpy(defaults, selected, sizeof(defaults));
+  memset(selected, 0, sizeof(selected));
+  for (int c = n - 1, j = k - 1; c >= 0; j = from[c * k + j] - 1, c--) {
+    selected[point[j]] = true;
+  }
+  delete[] best;
+  delete[] from;
+
+  // Add back default classes, filling the largest relative gaps first
+  for (int left = max_classes - n; left > 0; left--) {
+    int best_g = -1;
+    double best_ratio = 1;
+    size_t prev = 0;
+    for (int g = 0; g < kGridPoints; g++) {
+      if (selected[g]) {
+        prev = GridSize(g);
+      } else if (defaults[g]) {
+        // The gap "g" would split: from the previous class to the next
+        int next = g + 1;
+        while (!selected[next]) next++;
+        const double ratio = static_cast<double>(GridSize(next)) /
+                             (prev > 0 ? prev : kAlignment);
+        if (ratio > best_ratio) {
+          best_ratio = ratio;
+          best_g = g;
+        }
+      }
+    }
+    if (best_g < 0) break;
+    selected[best_g] = true;
+  }
+}
+
+static int OptimizeForHistogram(const char* filename, int max_classes) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return 1;
+  }
+  double allocations = 0, requested = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned long size;
+    double count;
+    if (line[0] == '#' || sscanf(line, "%lu %lf", &size, &count) != 2) {
+      continue;
+    }
+    if (size > kMaxSize || count <= 0) continue;
+    grid_count[GridPoint(size)] += count;
+    allocations += count;
+    requested += count * (size == 0 ? 1 : size);
+  }
+  fclose(f);
+  if (allocations == 0) {
+    fprintf(stderr, "%s: no allocation sizes found\n", filename);
+    return 1;
+  }
+
+  for (int cl = 1; cl < num_classes; cl++) {
+    selected[GridPoint(class_to_size[cl])] = true;
+  }
+  const double default_bytes = HandedOut();
+  OptimizeClasses(max_classes);
+  const double custom_bytes = HandedOut();
+
+  char summary[256];
+  snprintf(summary, sizeof(summary),
+           "%.0f allocations of %.0f bytes; rounding waste: "
+           "default %.0f bytes (%.1f%%), custom %.0f bytes (%.1f%%)",
+           allocations, requested,
+           default_bytes - requested,
+           100.0 * (default_bytes - requested) / requested,
+           custom_bytes - requested,
+           100.0 * (custom_bytes - requested) / requested);
+  fprintf(stderr, "%s\n", summary);
+
+  printf("# Size classes for TCMALLOC_SIZE_CLASSES_FILE, made by\n"
+         "# size_class_gen from %s\n"
+         "# %s\n",
+         filename, summary);
+  int n = 0;
+  for (int g = 0; g < kGridPoints; g++) {
+    if (!selected[g]) continue;
+    printf("%s%lu", (n == 0) ? "" : (n % 8 == 0) ? "\n" : " ",
+           static_cast<unsigned long>(GridSize(g)));
+    n++;
+  }
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  ComputeSizeClasses();
+
+  const char* histogram = NULL;
+  int max_classes = kNumClasses - 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--histogram") == 0 && i + 1 < argc) {
+      histogram = argv[++i];
+    } else if (strcmp(argv[i], "--classes") == 0 && i + 1 < argc) {
+      max_classes = atoi(argv[++i]);
+      if (max_classes < 1 || max_classes > kNumClasses - 1) {
+        fprintf(stderr, "--classes must be between 1 and %d\n",
+                kNumClasses - 1);
+        return 1;
+      }
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--histogram file [--classes n]]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (histogram != NULL) return OptimizeForHistogram(histogram, max_classes);
+
+  PrintTables();
+  return 0;
+}
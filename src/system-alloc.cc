@@ -38,10 +38,18 @@
 #else
 #include <sys/types.h>
 #endif
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <new>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux
+#include <sys/vfs.h>
+#endif
 #include "system-alloc.h"
+#include "google/malloc_interface.h"
 #include "internal_spinlock.h"
 #include "internal_logging.h"
 #include "base/commandlineflags.h"
@@ -53,8 +61,13 @@ union MemoryAligner {
   size_t s;
 };
 
+// Serializes calls to an installed allocator other than the default
+// one, which does its own locking (see TCMalloc_SystemAlloc()).
 static SpinLock spinlock = SPINLOCK_INITIALIZER;
-  
+
+// Protects /dev/mem and sbrk allocation
+static SpinLock fallback_lock = SPINLOCK_INITIALIZER;
+
 // Page size is initialized on demand
 static size_t pagesize = 0;
 
@@ -65,13 +78,42 @@ static size_t pagesize = 0;
 // the mmap address space (1300MBish) are disjoint, so we need both allocators
 // to get as much virtual memory as possible.
 static bool use_devmem = true;
+static bool use_reserve = true;
 static bool use_sbrk = true;
 static bool use_mmap = true;
 
-// Flags to keep us from retrying allocators that failed.
-static bool devmem_failure = false;
-static bool sbrk_failure = false;
-static bool mmap_failure = false;
+// Allocators that fail are not retried on every call.  After "n"
+// failures in a row an allocator is skipped by the next 2^n - 1 calls
+// (n is capped at kMaxBackoffShift); a success resets it.  The state
+// is updated without locking: a lost update only changes when the
+// allocator is tried again.
+static const int kMaxBackoffShift = 10;
+
+struct FailureState {
+  volatile int failures;        // Failures in a row
+  volatile int skip;            // Calls left to skip
+};
+
+static FailureState devmem_state = { 0, 0 };
+static FailureState reserve_state = { 0, 0 };
+static FailureState sbrk_state = { 0, 0 };
+
+static bool ShouldTry(FailureState* state) {
+  const int skip = state->skip;
+  if (skip <= 0) return true;
+  state->skip = skip - 1;
+  return false;
+}
+
+static void RecordResult(FailureState* state, bool success) {
+  if (success) {
+    if (state->failures != 0) state->failures = 0;
+    return;
+  }
+  int n = state->failures;
+  if (n < kMaxBackoffShift) state->failures = ++n;
+  state->skip = (1 << n) - 1;
+}
 
 DEFINE_int32(malloc_devmem_start, 0,
              "Physical memory starting location in MB for /dev/mem allocation."
@@ -86,7 +128,6 @@ static void* TrySbrk(size_t size, size_t alignment) {
   size = ((size + alignment - 1) / alignment) * alignment;
   void* result = sbrk(size);
   if (result == reinterpret_cast<void*>(-1)) {
-    sbrk_failure = true;
     return NULL;
   }
 
@@ -106,7 +147,6 @@ static void* TrySbrk(size_t size, size_t alignment) {
   // that we can find an aligned region within it.
   result = sbrk(size + alignment - 1);
   if (result == reinterpret_cast<void*>(-1)) {
-    sbrk_failure = true;
     return NULL;
   }
   ptr = reinterpret_cast<uintptr_t>(result);
@@ -136,7 +176,6 @@ static void* TryMmap(size_t size, size_t alignment) {
                       MAP_PRIVATE|MAP_ANONYMOUS,
                       -1, 0);
   if (result == reinterpret_cast<void*>(MAP_FAILED)) {
-    mmap_failure = true;
     return NULL;
   }
 
@@ -161,6 +200,154 @@ static void* TryMmap(size_t size, size_t alignment) {
 
 #endif /* HAVE_MMAP */
 
+#ifdef HAVE_MMAP
+
+// The heap grows through a large reservation of address space that is
+// committed from the bottom up, so consecutive allocations are
+// contiguous, live in one mapping and mostly cost no system call.  When
+// the reservation is used up its unused tail is unmapped and a new one
+// is made.  Address space is scarce on 32-bit machines, so the
+// reservations are smaller there.
+static const size_t kReserveBytes =
+    (sizeof(void*) >= 8) ? (static_cast<size_t>(1) << 30) : (64 << 20);
+
+// Memory is committed in chunks of this size, rounded up to cover the
+// request
+static const size_t kCommitBytes = 8 << 20;
+
+// A reservation starts with this header, so that a thread that still
+// sees a reservation after it has been replaced can only carve from
+// its committed part, which is never unmapped.
+struct Reservation {
+  volatile uintptr_t next;      // Next free byte
+  volatile uintptr_t committed; // End of the committed prefix
+  uintptr_t limit;              // End of the reservation
+};
+
+// The reservation memory is carved from.  Replaced, and committed
+// parts added, under reserve_lock; carving takes no lock where an
+// atomic compare-and-swap is available.
+static Reservation* volatile reservation = NULL;
+static SpinLock reserve_lock = SPINLOCK_INITIALIZER;
+
+#if (defined __i386__ || defined __x86_64__) && defined __GNUC__
+static const bool kLockFreeCarving = true;
+
+static inline bool CompareAndSwap(volatile uintptr_t* ptr,
+                                  uintptr_t old_value, uintptr_t new_value) {
+  uintptr_t prev;
+  __asm__ __volatile__("lock; cmpxchg %2, %1"
+                       : "=a"(prev), "+m"(*ptr)
+                       : "r"(new_value), "0"(old_value)
+                       : "memory");
+  return prev == old_value;
+}
+#else
+static const bool kLockFreeCarving = false;
+
+// Only called with reserve_lock held
+static inline bool CompareAndSwap(volatile uintptr_t* ptr,
+                                  uintptr_t old_value, uintptr_t new_value) {
+  if (*ptr != old_value) return false;
+  *ptr = new_value;
+  return true;
+}
+#endif
+
+// Carve "size" bytes aligned to "alignment" from the committed part of
+// "r".  Returns NULL if they do not fit.
+static void* CarveReserved(Reservation* r, size_t size, size_t alignment) {
+  while (true) {
+    const uintptr_t next = r->next;
+    const uintptr_t ptr = (next + alignment - 1) & ~(alignment - 1);
+    if (ptr + size < ptr || ptr + size > r->committed) return NULL;
+    if (CompareAndSwap(&r->next, next, ptr + size)) {
+      return reinterpret_cast<void*>(ptr);
+    }
+  }
+}
+
+// Commit enough of "r" for "size" bytes aligned to "alignment".
+// Returns false if they do not fit in "r" or the system refuses.
+// REQUIRES: reserve_lock is held
+static bool CommitReserved(Reservation* r, size_t size, size_t alignment,
+                           bool* refused) {
+  *refused = false;
+  const uintptr_t ptr = (r->next + alignment - 1) & ~(alignment - 1);
+  if (ptr + size < ptr || ptr + size > r->limit) return false;
+  // Commit the alignment gap too so that the committed memory stays
+  // one mapping; untouched pages use no memory.
+  uintptr_t end = (ptr + size + kCommitBytes - 1) & ~(kCommitBytes - 1);
+  if (end > r->limit) end = r->limit;
+  if (end <= r->committed) return true;
+  if (!TCMalloc_SystemCommit(reinterpret_cast<void*>(r->committed),
+                             end - r->committed)) {
+    *refused = true;
+    return false;
+  }
+  r->committed = end;
+  return true;
+}
+
+// Replace the reservation by a new one with room for "size" bytes
+// aligned to "alignment".  Returns false if the system refuses.
+// REQUIRES: reserve_lock is held
+static bool NewReservation(size_t size, size_t alignment) {
+  size_t bytes = size + alignment + pagesize;
+  if (bytes < kReserveBytes) bytes = kReserveBytes;
+  bytes = (bytes + pagesize - 1) & ~(pagesize - 1);
+  void* base = TCMalloc_SystemReserve(bytes);
+  if (base == NULL) return false;
+  if (!TCMalloc_SystemCommit(base, pagesize)) {
+    munmap(base, bytes);
+    return false;
+  }
+  Reservation* r = reinterpret_cast<Reservation*>(base);
+  r->next = reinterpret_cast<uintptr_t>(base) + sizeof(Reservation);
+  r->committed = reinterpret_cast<uintptr_t>(base) + pagesize;
+  r->limit = reinterpret_cast<uintptr_t>(base) + bytes;
+
+  Reservation* old = reservation;
+  reservation = r;
+  if (old != NULL && old->committed < old->limit) {
+    // Nobody can carve from above the committed part
+    munmap(reinterpret_cast<void*>(old->committed),
+           old->limit - old->committed);
+    old->limit = old->committed;
+  }
+  return true;
+}
+
+static void* TryReserved(size_t size, size_t alignment) {
+  if (pagesize == 0) pagesize = getpagesize();
+  size = ((size + alignment - 1) / alignment) * alignment;
+
+  if (kLockFreeCarving) {
+    Reservation* r = reservation;
+    if (r != NULL) {
+      void* result = CarveReserved(r, size, alignment);
+      if (result != NULL) return result;
+    }
+  }
+
+  SpinLockHolder h(&reserve_lock);
+  while (true) {
+    Reservation* r = reservation;
+    if (r != NULL) {
+      void* result = CarveReserved(r, size, alignment);
+      if (result != NULL) return result;
+      // Carving can only fail again if other threads took the newly
+      // committed memory first, so this loop makes progress.
+      bool refused;
+      if (CommitReserved(r, size, alignment, &refused)) continue;
+      if (refused) return NULL;
+    }
+    if (!NewReservation(size, alignment)) return NULL;
+  }
+}
+
+#endif /* HAVE_MMAP */
+
 static void* TryDevMem(size_t size, size_t alignment) {
   static bool initialized = false;
   static off_t physmem_base;  // next physical memory address to allocate
@@ -172,16 +359,15 @@ static void* TryDevMem(size_t size, size_t alignment) {
   // the next allocator.  (It looks like 7MB gets allocated before
   // this flag gets initialized -khr.)
   if (FLAGS_malloc_devmem_start == 0) {
-    // NOTE: not a devmem_failure - we'd like TCMalloc_SystemAlloc to
-    // try us again next time.
+    // NOTE: the caller checks this first, so that it is not counted
+    // as a failure and we are tried again next time.
     return NULL;
   }
   
   if (!initialized) {
     physmem_fd = open("/dev/mem", O_RDWR);
     if (physmem_fd < 0) {
-      devmem_failure = true;
-      return NULL;
+        return NULL;
     }
     physmem_base = FLAGS_malloc_devmem_start*1024LL*1024LL;
     physmem_limit = FLAGS_malloc_devmem_limit*1024LL*1024LL;
@@ -201,13 +387,11 @@ static void* TryDevMem(size_t size, size_t alignment) {
   
   // check to see if we have any memory left
   if (physmem_limit != 0 && physmem_base + size + extra > physmem_limit) {
-    devmem_failure = true;
     return NULL;
   }
   void *result = mmap(0, size + extra, PROT_WRITE|PROT_READ,
                       MAP_SHARED, physmem_fd, physmem_base);
   if (result == reinterpret_cast<void*>(MAP_FAILED)) {
-    devmem_failure = true;
     return NULL;
   }
   uintptr_t ptr = reinterpret_cast<uintptr_t>(result);
@@ -232,42 +416,438 @@ static void* TryDevMem(size_t size, size_t alignment) {
   return reinterpret_cast<void*>(ptr);
 }
 
+// The built-in allocators, tried in turn
+class DefaultSysAllocator : public SysAllocator {
+ public:
+  virtual void* Alloc(size_t size, size_t alignment);
+};
+
+void* DefaultSysAllocator::Alloc(size_t size, size_t alignment) {
+  // Each allocator is tried at most once, and not at all while it is
+  // backing off after failures.  mmap comes last and is always tried.
+  void* result;
+  if (use_devmem && FLAGS_malloc_devmem_start != 0 &&
+      ShouldTry(&devmem_state)) {
+    { // scope
+      SpinLockHolder h(&fallback_lock);
+      result = TryDevMem(size, alignment);
+    }
+    RecordResult(&devmem_state, result != NULL);
+    if (result != NULL) return result;
+  }
+
+#ifdef HAVE_MMAP
+  if (use_reserve && ShouldTry(&reserve_state)) {
+    result = TryReserved(size, alignment);
+    RecordResult(&reserve_state, result != NULL);
+    if (result != NULL) return result;
+  }
+#endif
+
+#ifdef HAVE_SBRK
+  if (use_sbrk && ShouldTry(&sbrk_state)) {
+    { // scope
+      SpinLockHolder h(&fallback_lock);
+      result = TrySbrk(size, alignment);
+    }
+    RecordResult(&sbrk_state, result != NULL);
+    if (result != NULL) return result;
+  }
+#endif
+
+#ifdef HAVE_MMAP
+  if (use_mmap) {
+    result = TryMmap(size, alignment);
+    if (result != NULL) return result;
+  }
+#endif
+  return NULL;
+}
+
+#if defined(__linux) && defined(HAVE_MMAP)
+
+// Takes memory from a file that is grown as needed and mapped shared,
+// so that the heap can live on hugetlbfs (or any other file system).
+// Set TCMALLOC_MEMFS_PATH to a path prefix such as
+// "/dev/hugepages/tcmalloc"; an unlinked file named after it is
+// created.  "memfd" and "memfd-huge" use an anonymous memfd instead,
+// the latter with huge pages.  Once the file cannot grow or be mapped,
+// all requests go to "fallback".  The kernel only checks that huge pages are
+// available when they are touched, so the hugetlbfs pool must be big
+// enough for the heap.
+class FileSysAllocator : public SysAllocator {
+ public:
+  FileSysAllocator(int fd, size_t page_size, SysAllocator* fallback)
+      : fd_(fd), page_size_(page_size), size_(0), failed_(false),
+        fallback_(fallback) {
+  }
+
+  virtual void* Alloc(size_t size, size_t alignment);
+  virtual bool Release(void* start, size_t length);
+
+ private:
+  int fd_;
+  size_t page_size_;            // Granularity of the file system
+  off_t size_;                  // Bytes of the file handed out
+  bool failed_;
+  SysAllocator* fallback_;
+};
+
+void* FileSysAllocator::Alloc(size_t size, size_t alignment) {
+  if (failed_) return fallback_->Alloc(size, alignment);
+
+  if (alignment < page_size_) alignment = page_size_;
+  size = ((size + page_size_ - 1) / page_size_) * page_size_;
+  if (ftruncate(fd_, size_ + size) != 0) {
+    failed_ = true;
+    return fallback_->Alloc(size, alignment);
+  }
+  void* result;
+  if (alignment == page_size_) {
+    result = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd_, size_);
+  } else {
+    // Reserve room to find an aligned address in, then map the file
+    // over the aligned part and give back the rest
+    const size_t extra = alignment - page_size_;
+    void* room = TCMalloc_SystemReserve(size + extra);
+    result = reinterpret_cast<void*>(MAP_FAILED);
+    if (room != NULL) {
+      const uintptr_t start = reinterpret_cast<uintptr_t>(room);
+      const uintptr_t ptr = (start + alignment - 1) & ~(alignment - 1);
+      result = mmap(reinterpret_cast<void*>(ptr), size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_FIXED, fd_, size_);
+      if (ptr > start) munmap(room, ptr - start);
+      if (start + size + extra > ptr + size) {
+        munmap(reinterpret_cast<void*>(ptr + size),
+               start + size + extra - (ptr + size));
+      }
+      if (result == reinterpret_cast<void*>(MAP_FAILED)) {
+        munmap(reinterpret_cast<void*>(ptr), size);
+      }
+    }
+  }
+  if (result == reinterpret_cast<void*>(MAP_FAILED)) {
+    failed_ = true;
+    // Nothing maps the part of the file added above.  If it cannot be
+    // cut off again, the file just stays that much bigger.
+    if (ftruncate(fd_, size_) != 0) {
+      MESSAGE("Cannot shrink TCMALLOC_MEMFS_PATH file back\n");
+    }
+    return fallback_->Alloc(size, alignment);
+  }
+  size_ += size;
+  return result;
+}
+
+bool FileSysAllocator::Release(void* start, size_t length) {
+  // Pages of a shared mapping that are only dropped stay in the file.
+  // MADV_REMOVE punches a hole in the file instead, the same as
+  // fallocate(FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE) on the range.
+  // The range has to cover whole pages of the file system (huge pages
+  // on hugetlbfs).  It fails for memory the fallback allocator handed
+  // out, which has the system page size.
+  static const int kMadvRemove = 9;     // From <linux/mman.h>
+  const uintptr_t begin = (reinterpret_cast<uintptr_t>(start) + page_size_ - 1)
+                          & ~(page_size_ - 1);
+  const uintptr_t end = (reinterpret_cast<uintptr_t>(start) + length)
+                        & ~(page_size_ - 1);
+  if (end > begin &&
+      madvise(reinterpret_cast<char*>(begin), end - begin, kMadvRemove) == 0) {
+    return true;
+  }
+  return fallback_->Release(start, length);
+}
+
+// Open the file TCMALLOC_MEMFS_PATH asks for.  Returns -1 on failure.
+static int OpenMemFile(const char* path) {
+  int fd = -1;
+  if (strcmp(path, "memfd") == 0 || strcmp(path, "memfd-huge") == 0) {
+#ifdef SYS_memfd_create
+    static const unsigned int kMfdCloexec = 0x0001U;
+    static const unsigned int kMfdHugetlb = 0x0004U;
+    const unsigned int flags = kMfdCloexec |
+        (strcmp(path, "memfd-huge") == 0 ? kMfdHugetlb : 0);
+    fd = syscall(SYS_memfd_create, "tcmalloc", flags);
+#endif
+  } else {
+    // mkstemp() and unlink() do not allocate memory
+    char name[4096];
+    const size_t len = strlen(path);
+    if (len + 8 > sizeof(name)) return -1;
+    memcpy(name, path, len);
+    memcpy(name + len, ".XXXXXX", 8);
+    fd = mkstemp(name);
+    if (fd >= 0) unlink(name);
+  }
+  return fd;
+}
+
+static SysAllocator* NewFileSysAllocator(SysAllocator* fallback) {
+  const char* path = getenv("TCMALLOC_MEMFS_PATH");
+  if (path == NULL || path[0] == '\0') return NULL;
+  const int fd = OpenMemFile(path);
+  if (fd < 0) {
+    MESSAGE("Cannot open TCMALLOC_MEMFS_PATH %s\n", path);
+    return NULL;
+  }
+  // hugetlbfs reports its page size as the block size
+  struct statfs fs;
+  if (pagesize == 0) pagesize = getpagesize();
+  size_t page_size = pagesize;
+  if (fstatfs(fd, &fs) == 0 && fs.f_bsize > 0) {
+    const size_t block_size = static_cast<size_t>(fs.f_bsize);
+    if (block_size > page_size && (block_size & (block_size - 1)) == 0) {
+      page_size = block_size;
+    }
+  }
+  static char memory[sizeof(FileSysAllocator)];
+  return new (memory) FileSysAllocator(fd, page_size, fallback);
+}
+
+#else
+
+static SysAllocator* NewFileSysAllocator(SysAllocator* fallback) {
+  return NULL;
+}
+
+#endif  /* __linux && HAVE_MMAP */
+
+// The allocator in use.  Written under spinlock.
+static SysAllocator* volatile sys_allocator = NULL;
+static SysAllocator* default_allocator = NULL;
+
+// REQUIRES: spinlock is held
+static void InitSysAllocator() {
+  if (sys_allocator != NULL) return;
+  static char memory[sizeof(DefaultSysAllocator)];
+  default_allocator = new (memory) DefaultSysAllocator;
+  SysAllocator* file = NewFileSysAllocator(default_allocator);
+  sys_allocator = (file != NULL) ? file : default_allocator;
+}
+
+SysAllocator* TCMalloc_GetSystemAllocator() {
+  SpinLockHolder lock_holder(&spinlock);
+  InitSysAllocator();
+  return sys_allocator;
+}
+
+void TCMalloc_SetSystemAllocator(SysAllocator* allocator) {
+  SpinLockHolder lock_holder(&spinlock);
+  sys_allocator = allocator;
+}
+
 void* TCMalloc_SystemAlloc(size_t size, size_t alignment) {
   if (TCMallocDebug::level >= TCMallocDebug::kVerbose) {
     MESSAGE("TCMalloc_SystemAlloc(%" PRIuS ", %" PRIuS")\n", 
             size, alignment);
   }
-  SpinLockHolder lock_holder(&spinlock);
-
   // Enforce minimum alignment
   if (alignment < sizeof(MemoryAligner)) alignment = sizeof(MemoryAligner);
 
-  // Try twice, once avoiding allocators that failed before, and once
-  // more trying all allocators even if they failed before.
-  for (int i = 0; i < 2; i++) {
-    if (use_devmem && !devmem_failure) {
-      void* result = TryDevMem(size, alignment);
-      if (result != NULL) return result;
-    }
-    
-#ifdef HAVE_SBRK
-    if (use_sbrk && !sbrk_failure) {
-      void* result = TrySbrk(size, alignment);
-      if (result != NULL) return result;
+  SysAllocator* allocator = sys_allocator;
+  if (allocator == NULL) {
+    SpinLockHolder lock_holder(&spinlock);
+    InitSysAllocator();
+    allocator = sys_allocator;
+  }
+  if (allocator == default_allocator) {
+    // Threads may grow the heap concurrently
+    return allocator->Alloc(size, alignment);
+  }
+  SpinLockHolder lock_holder(&spinlock);
+  return sys_allocator->Alloc(size, alignment);
+}
+
+size_t TCMalloc_SystemRelease(void* start, size_t length) {
+  if (pagesize == 0) pagesize = getpagesize();
+
+  // madvise() works on whole system pages
+  const uintptr_t begin = (reinterpret_cast<uintptr_t>(start) + pagesize - 1)
+                          & ~(pagesize - 1);
+  const uintptr_t end = (reinterpret_cast<uintptr_t>(start) + length)
+                        & ~(pagesize - 1);
+  if (end <= begin) return 0;
+
+  // The default allocator leaves releasing to madvise() below
+  SysAllocator* allocator = sys_allocator;
+  if (allocator != NULL && allocator != default_allocator) {
+    SpinLockHolder lock_holder(&spinlock);
+    if (sys_allocator->Release(reinterpret_cast<void*>(begin), end - begin)) {
+      return end - begin;
     }
+  }
+#ifdef MADV_DONTNEED
+  if (madvise(reinterpret_cast<char*>(begin), end - begin,
+              MADV_DONTNEED) != 0) {
+    return 0;
+  }
+  return end - begin;
+#else
+  return 0;
 #endif
+}
 
-#ifdef HAVE_MMAP    
-    if (use_mmap && !mmap_failure) {
-      void* result = TryMmap(size, alignment);
-      if (result != NULL) return result;
+void TCMalloc_SystemPrefault(void* start, size_t length) {
+  if (pagesize == 0) pagesize = getpagesize();
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(start)
+                          & ~(pagesize - 1);
+  const uintptr_t end = reinterpret_cast<uintptr_t>(start) + length;
+  if (end <= begin) return;
+#ifdef __linux
+  // MADV_POPULATE_WRITE (Linux 5.14) faults everything in with one call
+  static const int kMadvPopulateWrite = 23;
+  if (madvise(reinterpret_cast<char*>(begin), end - begin,
+              kMadvPopulateWrite) == 0) {
+    return;
+  }
+#endif
+  // Write to every page; reading would only map the shared zero page
+  for (uintptr_t p = begin; p < end; p += pagesize) {
+    volatile char* c = reinterpret_cast<volatile char*>(p);
+    *c = *c;
+  }
+}
+
+bool TCMalloc_SystemAdviseHugePages(void* start, size_t length, bool huge) {
+#ifdef __linux
+  // From <linux/mman.h>; older C libraries do not define them
+  static const int kMadvHugePage = 14;
+  static const int kMadvNoHugePage = 15;
+  if (pagesize == 0) pagesize = getpagesize();
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(start)
+                          & ~(pagesize - 1);
+  const uintptr_t end = (reinterpret_cast<uintptr_t>(start) + length
+                         + pagesize - 1) & ~(pagesize - 1);
+  return madvise(reinterpret_cast<char*>(begin), end - begin,
+                 huge ? kMadvHugePage : kMadvNoHugePage) == 0;
+#else
+  return false;
+#endif
+}
+
+void* TCMalloc_SystemReserve(size_t bytes) {
+#ifdef HAVE_MMAP
+  if (pagesize == 0) pagesize = getpagesize();
+  bytes = (bytes + pagesize - 1) & ~(pagesize - 1);
+  // PROT_NONE mappings are not counted against the commit limit
+  void* result = mmap(NULL, bytes, PROT_NONE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (result == reinterpret_cast<void*>(MAP_FAILED)) return NULL;
+  return result;
+#else
+  return NULL;
+#endif
+}
+
+bool TCMalloc_SystemCommit(void* start, size_t length) {
+#ifdef HAVE_MMAP
+  if (pagesize == 0) pagesize = getpagesize();
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(start)
+                          & ~(pagesize - 1);
+  const uintptr_t end = (reinterpret_cast<uintptr_t>(start) + length
+                         + pagesize - 1) & ~(pagesize - 1);
+  return mprotect(reinterpret_cast<void*>(begin), end - begin,
+                  PROT_READ|PROT_WRITE) == 0;
+#else
+  return false;
+#endif
+}
+
+// ---------------------------------------------------------------------
+// NUMA support.  We talk to the kernel directly instead of using
+// libnuma so that we do not pull in another library (which may call
+// malloc) and so we degrade gracefully on kernels without NUMA.
+// ---------------------------------------------------------------------
+
+// Memory policy mode from <numaif.h>
+static const int kMpolPreferred = 1;
+
+// Return one more than the highest number mentioned in a kernel
+// cpu/node list such as "0-1,3".  Returns 0 if no number is found.
+static int ParseHighestListEntry(const char* buf) {
+  int highest = -1;
+  int value = 0;
+  bool have_value = false;
+  for (const char* p = buf; ; p++) {
+    if (*p >= '0' && *p <= '9') {
+      value = value * 10 + (*p - '0');
+      have_value = true;
+    } else {
+      if (have_value && value > highest) highest = value;
+      value = 0;
+      have_value = false;
+      if (*p != '-' && *p != ',') break;
+    }
+  }
+  return highest + 1;
+}
+
+// Return the number of entries in the kernel list file "path", or 1
+// if it cannot be read.
+static int CountListFile(const char* path) {
+  // We read the file with plain read() because opendir() and stdio
+  // may allocate memory, and we are called from inside malloc.
+  int result = 1;
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    char buf[128];
+    const ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    if (r > 0) {
+      buf[r] = '\0';
+      const int n = ParseHighestListEntry(buf);
+      if (n > 1) result = n;
     }
+    close(fd);
+  }
+  return result;
+}
+
+int TCMalloc_NumaNodeCount() {
+  static int node_count = 0;
+  if (node_count == 0) {
+    node_count = CountListFile("/sys/devices/system/node/online");
+  }
+  return node_count;
+}
+
+int TCMalloc_NumCPUs() {
+  static int cpu_count = 0;
+  if (cpu_count == 0) {
+    cpu_count = CountListFile("/sys/devices/system/cpu/online");
+  }
+  return cpu_count;
+}
+
+bool TCMalloc_GetCpuAndNode(int* cpu, int* node) {
+#ifdef SYS_getcpu
+  unsigned int c, n;
+  if (syscall(SYS_getcpu, &c, &n, NULL) == 0) {
+    *cpu = c;
+    *node = n;
+    return true;
+  }
 #endif
+  *cpu = 0;
+  *node = 0;
+  return false;
+}
 
-    // nothing worked - reset failure flags and try again
-    devmem_failure = false;
-    sbrk_failure = false;
-    mmap_failure = false;
+bool TCMalloc_BindToNumaNode(void* ptr, size_t bytes, int node) {
+#ifdef SYS_mbind
+  if (node < 0 || node >= static_cast<int>(8 * sizeof(unsigned long))) {
+    return false;
   }
-  return NULL;
+  if (pagesize == 0) pagesize = getpagesize();
+
+  // mbind() requires a page-aligned start address
+  uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+  const uintptr_t end = start + bytes;
+  start &= ~(pagesize - 1);
+
+  unsigned long nodemask = 1UL << node;
+  return syscall(SYS_mbind, start, end - start, kMpolPreferred,
+                 &nodemask, 8 * sizeof(nodemask), 0) == 0;
+#else
+  return false;
+#endif
 }
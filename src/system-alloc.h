@@ -40,7 +40,69 @@
 //
 // Allocate and return "N" bytes of zeroed memory.  The returned
 // pointer is a multiple of "alignment" if non-zero.  Returns NULL
-// when out of memory.
+// when out of memory.  Successive calls are usually carved from one
+// big reservation of address space, and so are contiguous.  Threads
+// may call this concurrently; with the default allocator, most calls
+// take no lock.
 extern void* TCMalloc_SystemAlloc(size_t bytes, size_t alignment = 0);
 
+class SysAllocator;
+
+// The allocator TCMalloc_SystemAlloc() takes memory from.  By default
+// it tries /dev/mem, reserved address space, sbrk and mmap in turn.
+// If TCMALLOC_MEMFS_PATH is set, memory comes from files instead (see
+// system-alloc.cc), falling back to the default allocator.
+extern SysAllocator* TCMalloc_GetSystemAllocator();
+
+// Take memory from "allocator" from now on (see
+// MallocInterface::SetSystemAllocator()).
+extern void TCMalloc_SetSystemAllocator(SysAllocator* allocator);
+
+// Tell the system that the contents of "[start, start+length)" are no
+// longer needed.  The memory stays allocated, but may read back as
+// zeros the next time it is touched.  Only whole system pages inside
+// the range are released.  Returns the number of bytes released.
+extern size_t TCMalloc_SystemRelease(void* start, size_t length);
+
+// Back the pages covering "[start, start+length)" by memory now, so
+// that touching them later does not fault.  The contents are kept.
+extern void TCMalloc_SystemPrefault(void* start, size_t length);
+
+// Advise the kernel to back the pages covering "[start,
+// start+length)" by transparent huge pages if "huge", or never to do
+// so otherwise.  Returns false if the kernel has no such support.
+extern bool TCMalloc_SystemAdviseHugePages(void* start, size_t length,
+                                           bool huge);
+
+// Reserve "bytes" of address space without any memory behind it.
+// Parts of the range must be committed with TCMalloc_SystemCommit()
+// before they are touched.  Returns NULL if the address space cannot
+// be reserved.
+extern void* TCMalloc_SystemReserve(size_t bytes);
+
+// Make "[start, start+length)", which must lie inside a range returned
+// by TCMalloc_SystemReserve(), readable and writable.  Whole system
+// pages covering the range are committed; memory is only used once a
+// page is touched, and reads as zeros until written.  Returns false if
+// the system refuses.
+extern bool TCMalloc_SystemCommit(void* start, size_t length);
+
+// Return the number of NUMA nodes on this machine.  Always >= 1; a
+// machine without NUMA support is treated as a single node.
+extern int TCMalloc_NumaNodeCount();
+
+// Return the number of cpus threads may run on.  Always >= 1.
+extern int TCMalloc_NumCPUs();
+
+// Store the cpu and NUMA node the calling thread is currently running
+// on into "*cpu" and "*node".  Returns false if this information is
+// not available, in which case both are set to 0.
+extern bool TCMalloc_GetCpuAndNode(int* cpu, int* node);
+
+// Ask the kernel to prefer NUMA node "node" when backing the pages in
+// "[ptr, ptr+bytes-1]".  Must be called before the memory is touched.
+// Returns false if the policy could not be applied (e.g., no NUMA
+// support or "node" does not exist); the memory is still usable.
+extern bool TCMalloc_BindToNumaNode(void* ptr, size_t bytes, int node);
+
 #endif /* TCMALLOC_SYSTEM_ALLOC_H__ */
@@ -41,16 +41,67 @@
 //     This is safe because each such list is only accessed by one thread.
 //  2. We have a lock per central free-list, and hold it while manipulating
 //     the central free list for a particular size.
-//  3. The central page allocator is protected by "pageheap_lock".
+//  3. The central page allocator is split into partitions (see NUMA
+//     and SHARDS below).  Each partition is protected by its own
+//     "lock_", which also covers the span descriptors it allocates.
+//     "pageheap_lock" only protects initialization and the choice of
+//     how many partitions are in use.
 //  4. The pagemap (which maps from page-number to descriptor),
 //     can be read without holding any locks, and written while holding
-//     the "pageheap_lock".
+//     the lock of the partition that owns the pages being mapped.
+//     Interior nodes of the pagemap are created under "pagemap_lock".
+//     The leaves that only cover the interior of a big free span are
+//     given back under the same lock (see ReleaseInterior); readers
+//     that still look at such a page see an empty entry.
 //
 //     This multi-threaded access to the pagemap is safe for fairly
 //     subtle reasons.  We basically assume that when an object X is
 //     allocated by thread A and deallocated by thread B, there must
 //     have been appropriate synchronization in the handoff of object
-//     X from thread A to thread B.
+//     X from thread A to thread B.  A partition may also read the
+//     entry of a page just outside a span it owns while coalescing;
+//     such an entry may be stale, but span descriptors are never
+//     handed from one partition to another, so the "heap" field read
+//     through it tells reliably whether the neighbor is ours.
+//  5. The list of thread heaps and the thread cache size budget are
+//     protected by "threadheap_lock".
+//  6. The list of sampled objects and their stack traces are protected
+//     by "sample_lock".
+//  7. The metadata byte count has its own leaf lock, "metadata_lock".
+//  8. The count of bytes the page heap got from the system, which the
+//     heap limits are checked against, has its own leaf lock,
+//     "heap_limit_lock".
+//
+//  LOCK ORDER: a thread holding one of these locks may only acquire
+//  locks that come later in this list:
+//        threadheap_lock
+//        central_cache[cl].lock_ (at most one at a time)
+//        sample_lock
+//        pageheap_lock
+//        pageheaps[i]->lock_ (at most one at a time)
+//        pagemap_lock
+//        metadata_lock
+//        heap_limit_lock
+//  In practice the central free lists drop their lock before calling
+//  into the page heap, and sample_lock is never held together with
+//  a page heap lock; the order above is what the code may rely on.
+//
+// NUMA
+//  The page heap may be split into one partition per NUMA node (see
+//  "tcmalloc.numa_partitions").  Every partition grows from system
+//  memory that is bound to its node, page-level allocations are served
+//  from the partition of the node the calling thread runs on, and a
+//  freed span always goes back to the partition that owns it.  All
+//  partitions share a single pagemap; spans are never coalesced
+//  across partitions.
+//
+// SHARDS
+//  Independently of NUMA, the page heap of every node may be split
+//  into several shards (see "tcmalloc.pageheap_shards") so that
+//  threads doing page-level allocations in parallel do not serialize
+//  on one lock.  A shard is just another partition: it grows its own
+//  address ranges from the system, threads pick a shard by cpu, and
+//  frees find the owning shard through the span descriptor.
 //
 // TODO: Bias reclamation to larger addresses
 // TODO: implement mallinfo/mallopt
@@ -78,7 +129,9 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <sys/time.h>
 #include "google/malloc_hook.h"
 #include "google/malloc_interface.h"
 #include "google/stacktrace.h"
@@ -101,13 +154,27 @@
 
 // Not all possible combinations of the following parameters make
 // sense.  In particular, if kMaxSize increases, you may have to
-// increase kNumClasses as well.
-static const size_t kPageShift  = 12;
+// increase kNumClasses as well.  The size class tables depend on
+// kMaxSize, kAlignShift and the object move limits below; after
+// changing any of them, update src/size_class_gen.cc to match and run
+// "make size-classes".
+//
+// The page size is chosen at build time; larger pages mean fewer
+// spans and pagemap entries for the same heap, at the cost of more
+// internal fragmentation in page-level allocations.  See
+// "--with-tcmalloc-pagesize" in configure.
+#ifndef TCMALLOC_PAGE_SHIFT
+#define TCMALLOC_PAGE_SHIFT 12
+#endif
+#if TCMALLOC_PAGE_SHIFT < 12 || TCMALLOC_PAGE_SHIFT > 16
+#error "TCMALLOC_PAGE_SHIFT must be between 12 (4KB) and 16 (64KB)"
+#endif
+static const size_t kPageShift  = TCMALLOC_PAGE_SHIFT;
 static const size_t kPageSize   = 1 << kPageShift;
-static const size_t kMaxSize    = 8u * kPageSize;
+static const size_t kMaxSize    = 256u << 10;
 static const size_t kAlignShift = 3;
 static const size_t kAlignment  = 1 << kAlignShift;
-static const size_t kNumClasses = 170;
+static const size_t kNumClasses = 200;
 
 // Minimum number of pages to fetch from system at a time.  Must be
 // significantly bigger than kBlockSize to amortize system-call
@@ -121,8 +188,12 @@ static const int kMinSystemAlloc = 1 << (20 - kPageShift);
 // list in one shot.  We want this to be not too small so we can
 // amortize the lock overhead for accessing the central list.  Making
 // it too big may temporarily cause unnecessary memory wastage in the
-// per-thread free list until the scavenger cleans up the list.
+// per-thread free list until the scavenger cleans up the list.  For
+// big size classes fewer objects are moved (see class_to_move), so
+// that one move is about kBytesToMove bytes.
 static const int kNumObjectsToMove = 32;
+static const int kMinObjectsToMove = 2;
+static const size_t kBytesToMove = 64 << 10;
 
 // Maximum length we allow a per-thread free-list to have before we
 // move objects from it into the corresponding central free-list.  We
@@ -138,10 +209,37 @@ static const size_t kMaxThreadCacheSize = 2 << 20;
 // Default bound on the total amount of thread caches
 static const size_t kDefaultOverallThreadCacheSize = 16 << 20;
 
+// Page-level spans of at most this many pages are kept in a per-thread
+// cache when freed so that the next allocation of the same length does
+// not have to take a page heap lock.  The bytes held in this cache per
+// thread are bounded by the per-thread cache size.
+static const size_t kMaxCachedLargePages = (512 << 10) >> kPageShift;
+
+// With adaptive_span_pages, a size class whose central cache keeps
+// fetching spans without giving any back fetches spans of up to
+// kMaxSpanScale times class_to_pages[] pages, as long as they are at
+// most kMaxAdaptedSpanBytes.  The scale is reconsidered every
+// kSpanScaleInterval spans fetched.
+static const int kMaxSpanScale = 16;
+static const size_t kMaxAdaptedSpanBytes = 256 << 10;
+static const int kSpanScaleInterval = 8;
+
+// Longest span Span::length can describe
+static const size_t kMaxSpanLength = 0xffffffffu;
+
 // For all span-lengths < kMaxPages we keep an exact-size list.
 // REQUIRED: kMaxPages >= kMinSystemAlloc;
 static const size_t kMaxPages = kMinSystemAlloc;
 
+// Maximum number of NUMA nodes with a page heap partition of their own
+static const int kMaxNumaNodes = 8;
+
+// Maximum number of page heap shards per node.  There are at most
+// kMaxNumaNodes * kMaxPageHeapShards partitions, which must fit in
+// Span::heap.
+static const int kMaxPageHeapShards = 8;
+static const int kMaxPageHeaps = kMaxNumaNodes * kMaxPageHeapShards;
+
 // Twice the approximate gap between sampling actions.
 // I.e., we take one sample approximately once every
 //      kSampleParameter/2
@@ -153,54 +251,32 @@ static const size_t kSampleParameter = 266053;
 // Mapping from size to size_class and vice versa
 //-------------------------------------------------------------------
 
-// A pair of arrays we use for implementing the mapping from a size to
-// its size class.  Indexed by "floor(lg(size))".
-static const int kSizeBits = 8 * sizeof(size_t);
-static unsigned char size_base[kSizeBits];
-static unsigned char size_shift[kSizeBits];
-
-// Mapping from size class to size
-static size_t class_to_size[kNumClasses];
-
-// Mapping from size class to number of pages to allocate at a time
-static size_t class_to_pages[kNumClasses];
-
-// Return floor(log2(n)) for n > 0.
-#if defined __i386__ && defined __GNUC__
-static inline int LgFloor(size_t n) {
-  // "ro" for the input spec means the input can come from either a
-  // register ("r") or offsetable memory ("o").
-  int result;
-  __asm__("bsrl  %1, %0"
-          : "=r" (result)               // Output spec
-          : "ro" (n)                    // Input spec
-          : "cc"                        // Clobbers condition-codes
-          );
-  return result;
-}
-#else
-// Note: the following only works for "n"s that fit in 32-bits, but
-// that is fine since we only use it for small sizes.
-static inline int LgFloor(size_t n) {
-  int log = 0;
-  for (int i = 4; i >= 0; --i) {
-    int shift = (1 << i);
-    size_t x = n >> shift;
-    if (x != 0) {
-      n = x;
-      log += shift;
-    }
-  }
-  ASSERT(n == 1);
-  return log;
-}
-#endif
+// The tables that map between sizes and size classes are computed by
+// size_class_gen when the sources are generated, not at startup.  They
+// define:
+//   small_size_class[]  size class of each size up to kMaxSmallSize,
+//                       indexed by "(size + kAlignment - 1) >> kAlignShift"
+//   large_size_class[]  size class of each bigger size, indexed by
+//                       "(size + 2^kLargeSizeShift - 1) >> kLargeSizeShift"
+//   class_to_size[]     mapping from size class to size
+//   class_to_pages[]    mapping from size class to number of pages to
+//                       allocate at a time
+//   class_to_move[]     mapping from size class to number of objects to
+//                       move between a thread cache and the central
+//                       cache at a time
+// All of them may be replaced at startup by a custom set of classes
+// (see TCMALLOC_SIZE_CLASSES below).
+#include "size_classes.h"
+
+// Number of size classes in use, including the unused class 0
+static int num_size_classes = kSizeClassesCount;
 
 static inline int SizeClass(size_t size) {
-  if (size == 0) size = 1;
-  const int lg = LgFloor(size);
-  const int align = size_shift[lg];
-  return static_cast<int>(size_base[lg]) + ((size-1) >> align);
+  if (size <= kMaxSmallSize) {
+    return small_size_class[(size + kAlignment - 1) >> kAlignShift];
+  }
+  const size_t step = 1 << kLargeSizeShift;
+  return large_size_class[(size + step - 1) >> kLargeSizeShift];
 }
 
 // Get the byte-size for a specified class
@@ -208,58 +284,18 @@ static inline size_t ByteSizeForClass(size_t cl) {
   return class_to_size[cl];
 }
 
-// Initialize the mapping arrays
-static void InitSizeClasses() {
-  // Special initialization for small sizes
-  for (int lg = 0; lg < kAlignShift; lg++) {
-    size_base[lg] = 1;
-    size_shift[lg] = kAlignShift;
-  }
-
-  int next_class = 1;
-  int alignshift = kAlignShift;
-  int last_lg = -1;
-  for (size_t size = kAlignment; size <= kMaxSize; size += (1 << alignshift)) {
-    int lg = LgFloor(size);
-    if (lg > last_lg) {
-      // Increase alignment every so often.
-      //
-      // Since we double the alignment every time size doubles and
-      // size >= 128, this means that space wasted due to alignment is
-      // at most 16/128 i.e., 12.5%.  Plus we cap the alignment at 256
-      // bytes, so the space wasted as a percentage starts falling for
-      // sizes > 2K.
-      if ((lg >= 7) && (alignshift < 8)) {
-        alignshift++;
-      }
-      size_base[lg] = next_class - ((size-1) >> alignshift);
-      size_shift[lg] = alignshift;
-    }
-
-    class_to_size[next_class] = size;
-    last_lg = lg;
-
-    next_class++;
-  }
-  if (next_class >= kNumClasses) {
-    MESSAGE("used up too many size classes: %d\n", next_class);
-    abort();
-  }
-
-  // Initialize the number of pages we should allocate to split into
-  // small objects for a given class.
-  for (size_t cl = 1; cl < next_class; cl++) {
-    // Allocate enough pages so leftover is less than 1/8 of total.
-    // This bounds wasted space to at most 12.5%.
-    size_t psize = kPageSize;
+// Check the mapping arrays
+static void CheckSizeClasses() {
+  for (int cl = 1; cl < num_size_classes; cl++) {
     const size_t s = class_to_size[cl];
-    while ((psize % s) > (psize >> 3)) {
-      psize += kPageSize;
+    const size_t psize = class_to_pages[cl] << kPageShift;
+    if (psize % s > (psize >> 3) || class_to_move[cl] < kMinObjectsToMove ||
+        class_to_move[cl] > kNumObjectsToMove) {
+      MESSAGE("Bad tables for class %d\n", cl);
+      abort();
     }
-    class_to_pages[cl] = psize >> kPageShift;
   }
 
-  // Double-check sizes just to be safe
   for (size_t size = 0; size <= kMaxSize; size++) {
     const int sc = SizeClass(size);
     if (sc == 0) {
@@ -271,7 +307,7 @@ static void InitSizeClasses() {
               "\n", sc, size);
       abort();
     }
-    if (sc >= kNumClasses) {
+    if (sc >= num_size_classes) {
       MESSAGE("Bad size class %d for %" PRIuS "\n", sc, size);
       abort();
     }
@@ -287,16 +323,210 @@ static void InitSizeClasses() {
   }
 }
 
+// Replace the size classes with classes of the given "sizes", which
+// must be increasing multiples of the lookup step of their range (8
+// bytes up to kMaxSmallSize, 2^kLargeSizeShift above) and at most
+// kMaxSize.  A class of kMaxSize is added if missing.  Returns false,
+// leaving the tables alone, if the sizes cannot be used.
+static bool SetSizeClasses(const size_t* sizes, int n) {
+  const size_t large_step = 1 << kLargeSizeShift;
+  const bool add_max = (n == 0 || sizes[n-1] != kMaxSize);
+  const int max_classes = kNumClasses - 1;    // Class 0 is not used
+  if (n + add_max > max_classes) {
+    MESSAGE("Too many size classes: %d (at most %d)\n",
+            n + add_max, max_classes);
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    const size_t s = sizes[i];
+    const size_t step = (s <= kMaxSmallSize) ? kAlignment : large_step;
+    if (s == 0 || s > kMaxSize || s % step != 0 ||
+        (i > 0 && s <= sizes[i-1])) {
+      MESSAGE("Bad size class %" PRIuS ": sizes must increase, be at most "
+              "%" PRIuS ", and be multiples of %" PRIuS "\n",
+              s, kMaxSize, step);
+      return false;
+    }
+  }
+
+  memset(class_to_size, 0, sizeof(class_to_size));
+  memset(class_to_pages, 0, sizeof(class_to_pages));
+  memset(class_to_move, 0, sizeof(class_to_move));
+  num_size_classes = n + add_max + 1;
+  for (int cl = 1; cl < num_size_classes; cl++) {
+    const size_t s = (cl <= n) ? sizes[cl-1] : kMaxSize;
+    class_to_size[cl] = s;
+
+    int move = kBytesToMove / s;
+    if (move > kNumObjectsToMove) move = kNumObjectsToMove;
+    if (move < kMinObjectsToMove) move = kMinObjectsToMove;
+    class_to_move[cl] = move;
+
+    // Allocate enough pages so leftover is less than 1/8 of total.
+    // This bounds wasted space to at most 12.5%.
+    size_t psize = kPageSize;
+    while ((psize % s) > (psize >> 3)) {
+      psize += kPageSize;
+    }
+    class_to_pages[cl] = psize >> kPageShift;
+  }
+
+  // Each table entry stands for the biggest size it covers
+  int cl = 1;
+  for (size_t i = 0; i <= (kMaxSmallSize >> kAlignShift); i++) {
+    while (class_to_size[cl] < (i << kAlignShift)) cl++;
+    small_size_class[i] = cl;
+  }
+  for (size_t i = 0; i <= (kMaxSize >> kLargeSizeShift); i++) {
+    const size_t size = i << kLargeSizeShift;
+    if (size <= kMaxSmallSize) {
+      large_size_class[i] = 0;
+      continue;
+    }
+    while (class_to_size[cl] < size) cl++;
+    large_size_class[i] = cl;
+  }
+  return true;
+}
+
+// Parse a list of sizes separated by commas or white space into
+// "sizes"; "#" starts a comment that runs to the end of the line.
+// Returns the number of sizes, or -1 if "text" is not such a list or
+// a size is bigger than kMaxSize.
+static int ParseSizeClasses(const char* text, size_t* sizes, int max) {
+  int n = 0;
+  const char* p = text;
+  while (*p != '\0') {
+    if (*p == '#') {
+      while (*p != '\0' && *p != '\n') p++;
+    } else if (*p == ',' || *p == ' ' || *p == '\t' ||
+               *p == '\n' || *p == '\r') {
+      p++;
+    } else if (*p >= '0' && *p <= '9') {
+      size_t value = 0;
+      for (; *p >= '0' && *p <= '9'; p++) {
+        value = value * 10 + (*p - '0');
+        if (value > kMaxSize) return -1;
+      }
+      if (n == max) return -1;
+      sizes[n++] = value;
+    } else {
+      return -1;
+    }
+  }
+  return n;
+}
+
+// Read all of "filename" into "buf", which gets NUL-terminated.  Uses
+// no memory allocation since it runs while malloc is initialized.
+static bool ReadWholeFile(const char* filename, char* buf, int size) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  int length = 0;
+  while (length < size - 1) {
+    const int r = read(fd, buf + length, size - 1 - length);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    length += r;
+  }
+  close(fd);
+  buf[length] = '\0';
+  return true;
+}
+
+// Install custom size classes from TCMALLOC_SIZE_CLASSES, a list of
+// sizes, or from the file named by TCMALLOC_SIZE_CLASSES_FILE (see
+// size_class_gen for making one from an allocation size histogram).
+// The default tables stay if neither is set or the classes are bad.
+// Returns true if custom classes were installed.
+static bool LoadCustomSizeClasses() {
+  static char text[16 << 10];
+  const char* list = getenv("TCMALLOC_SIZE_CLASSES");
+  const char* filename = getenv("TCMALLOC_SIZE_CLASSES_FILE");
+  if (list == NULL && filename != NULL) {
+    if (!ReadWholeFile(filename, text, sizeof(text))) {
+      MESSAGE("Cannot read size classes from %s\n", filename);
+      return false;
+    }
+    list = text;
+  }
+  if (list == NULL) return false;
+
+  size_t sizes[kNumClasses];
+  const int n = ParseSizeClasses(list, sizes, kNumClasses);
+  if (n < 0) {
+    MESSAGE("Cannot parse the custom size classes\n");
+    return false;
+  }
+  if (!SetSizeClasses(sizes, n)) {
+    MESSAGE("Using the default size classes\n");
+    return false;
+  }
+  return true;
+}
+
+// Set up the mapping arrays.  The default tables have been checked by
+// size_class_gen when it made them, so they are only checked again in
+// debug builds; custom ones are always checked.
+static void InitSizeClasses() {
+  if (kSizeClassesMaxSize != kMaxSize || kSizeClassesCount > kNumClasses) {
+    MESSAGE("size_classes.h does not match kMaxSize and kNumClasses\n");
+    abort();
+  }
+  const bool custom = LoadCustomSizeClasses();
+#ifdef NDEBUG
+  if (!custom) return;
+#else
+  (void) custom;        // Debug builds check the built-in classes too
+#endif
+  CheckSizeClasses();
+}
+
 // -------------------------------------------------------------------------
 // Simple allocator for objects of a specified type.  External locking
 // is required before accessing one of these objects.
 // -------------------------------------------------------------------------
 
-// Metadata allocator -- keeps stats about how many bytes allocated
+// Metadata allocator -- keeps stats about how many bytes allocated.
+// metadata_system_bytes is protected by metadata_lock because metadata
+// is allocated under several different locks.
+static SpinLock metadata_lock = SPINLOCK_INITIALIZER;
 static uint64_t metadata_system_bytes = 0;
+
+// Transparent huge page advice given for new heap and metadata memory
+// (the pagemap is not covered).  Leaving it to the system makes the
+// behavior depend on the host's THP setting.  The heap benefits from
+// huge pages; memory that is small or released page by page does not.
+static const int kHugePagesDefault = 0;       // Give no advice
+static const int kHugePagesAlways = 1;        // MADV_HUGEPAGE
+static const int kHugePagesNever = 2;         // MADV_NOHUGEPAGE
+static volatile int heap_huge_pages = kHugePagesDefault;
+static volatile int metadata_huge_pages = kHugePagesDefault;
+
+// Bytes the advice was taken for, indexed by the advice.  Protected
+// by metadata_lock.
+static uint64_t huge_pages_advised_bytes[3] = { 0, 0, 0 };
+
+// Clip a user-supplied advice to a valid one
+static int HugePagesAdvice(size_t value) {
+  return (value <= kHugePagesNever) ? static_cast<int>(value)
+                                    : kHugePagesDefault;
+}
+
+static void AdviseHugePages(void* ptr, size_t bytes, int advice) {
+  if (advice == kHugePagesDefault) return;
+  if (TCMalloc_SystemAdviseHugePages(ptr, bytes,
+                                     advice == kHugePagesAlways)) {
+    SpinLockHolder h(&metadata_lock);
+    huge_pages_advised_bytes[advice] += bytes;
+  }
+}
+
 static void* MetaDataAlloc(size_t bytes) {
   void* result = TCMalloc_SystemAlloc(bytes);
   if (result != NULL) {
+    AdviseHugePages(result, bytes, metadata_huge_pages);
+    SpinLockHolder h(&metadata_lock);
     metadata_system_bytes += bytes;
   }
   return result;
@@ -389,17 +619,36 @@ static size_t AllocationSize(size_t bytes) {
   }
 }
 
-// Information kept for a span (a contiguous run of pages).
+// Information kept for a span (a contiguous run of pages).  We have a
+// lot of these, so the length and the flags share one word, which makes
+// a span 40 instead of 48 bytes on 64-bit machines.  The fields that
+// are touched when an object is freed into the central cache (the flags,
+// "length" and "objects") are next to each other.  "start" comes first
+// because the span allocator overwrites the first word of a deleted
+// span, and the flags must survive that (see TCMalloc_PageHeap::NewSpan).
 struct Span {
   PageID        start;          // Starting page number
-  Length        length;         // Number of pages in span
-  Span*         next;           // Used when in link list
-  Span*         prev;           // Used when in link list
-  void*         objects;        // Linked list of free objects
   unsigned int  free : 1;       // Is the span free
   unsigned int  sample : 1;     // Sampled object?
-  unsigned int  sizeclass : 8;  // Size-class for small objects (or 0)
-  unsigned int  refcount : 11;  // Number of non-free objects
+  unsigned int  sizeclass : 8;  // Size-class for small objects (or 0,
+                                // or kDeferredSpanClass)
+  unsigned int  heap : 6;       // Page heap partition that owns the span
+  unsigned int  released : 1;   // Some pages given back to the system?
+                                // Of a free span: set by the page heap
+                                // (see "released_pages").  Of a span
+                                // of a size class: set by the central
+                                // cache, the pages are marked with
+                                // kReleasedPageClass.  Delete() clears
+                                // it between the two uses.
+  unsigned int  refcount : 15;  // Number of non-free objects
+  uint32_t      length;         // Number of pages in span
+  union {
+    void*       objects;        // Linked list of free objects
+    uintptr_t   released_pages; // Of a free span: pages counted as
+                                // given back (see heap_released_bytes)
+  };
+  Span*         next;           // Used when in link list
+  Span*         prev;           // Used when in link list
 
 #undef SPAN_HISTORY
 #ifdef SPAN_HISTORY
@@ -421,25 +670,126 @@ void Event(Span* span, char op, int v = 0) {
 #define Event(s,o,v) ((void) 0)
 #endif
 
-// Allocator/deallocator for spans
-static PageHeapAllocator<Span> span_allocator;
-static Span* NewSpan(PageID p, Length len) {
-  Span* result = span_allocator.New();
-  memset(result, 0, sizeof(*result));
-  result->start = p;
-  result->length = len;
-#ifdef SPAN_HISTORY
-  result->nexthistory = 0;
-#endif
-  return result;
+// -------------------------------------------------------------------------
+// Page heap event trace
+//   A global ring buffer of the most recent page heap operations, so
+//   that we can find out after the fact how a heap got fragmented (see
+//   "tcmalloc.pageheap_trace").  Writers claim a slot with an atomic
+//   increment and never block.  An entry that is overwritten while the
+//   buffer is being dumped may come out garbled.
+// -------------------------------------------------------------------------
+
+// Trace event codes.  Each event names a span "[page, page+length-1]".
+static const char kTraceGrow     = 'G';  // Got memory from the system
+static const char kTraceNew      = 'A';  // New() returned the span
+static const char kTraceLeftover = 'L';  // Free rest of a span New() used
+static const char kTraceSplit    = 'T';  // Split() shortened span to length
+static const char kTraceClass    = 'C';  // Span now holds small objects
+static const char kTraceDelete   = 'F';  // Delete() got the span back
+static const char kTraceDefer    = 'd';  // ... and kept it uncoalesced
+static const char kTraceReuse    = 'a';  // New() returned a kept span
+static const char kTraceFree     = 'M';  // Span is free after coalescing
+
+struct PageHeapEvent {
+  uint64_t      time;           // Time stamp counter (or usecs)
+  uint64_t      page;           // Starting page number
+  uint32_t      length;         // Number of pages
+  unsigned char op;             // One of the codes above
+  unsigned char sizeclass;      // Size class for kTraceClass
+  unsigned char heap;           // Page heap partition
+  unsigned char unused;
+};
+
+static const size_t kTraceEvents = 1 << 16;         // Must be a power of two
+static PageHeapEvent* trace_buffer = NULL;          // Allocated on first use
+static volatile uintptr_t trace_next = 0;           // Events ever recorded
+static volatile bool pageheap_trace_enabled = false;
+
+#if (defined __i386__ || defined __x86_64__) && defined __GNUC__
+static inline uintptr_t TraceClaimSlot() {
+  uintptr_t slot = 1;
+  __asm__ __volatile__("lock; xadd %0, %1"
+                       : "+r"(slot), "+m"(trace_next)
+                       :
+                       : "memory");
+  return slot;
 }
 
-static void DeleteSpan(Span* span) {
-#ifndef NDEBUG
-  // In debug mode, trash the contents of deleted Spans
-  memset(span, 0x3f, sizeof(*span));
+static inline uint64_t TraceTimestamp() {
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+#else
+static SpinLock trace_lock = SPINLOCK_INITIALIZER;
+static inline uintptr_t TraceClaimSlot() {
+  SpinLockHolder h(&trace_lock);
+  return trace_next++;
+}
+
+static inline uint64_t TraceTimestamp() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
 #endif
-  span_allocator.Delete(span);
+
+static void RecordPageHeapEvent(char op, int heap, uintptr_t page,
+                                size_t length, int cl) {
+  PageHeapEvent* e = &trace_buffer[TraceClaimSlot() & (kTraceEvents - 1)];
+  e->time = TraceTimestamp();
+  e->page = page;
+  e->length = length;
+  e->op = op;
+  e->sizeclass = cl;
+  e->heap = heap;
+}
+
+static inline void TracePageHeap(char op, int heap, uintptr_t page,
+                                 size_t length, int cl = 0) {
+  if (pageheap_trace_enabled) RecordPageHeapEvent(op, heap, page, length, cl);
+}
+
+// Write the events in the trace buffer, oldest first, to "filename"
+// as text.  Returns false if the file cannot be written.
+static bool WritePageHeapTrace(const char* filename) {
+  if (trace_buffer == NULL) return false;
+  const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+
+  const uintptr_t end = trace_next;
+  const uintptr_t start = (end > kTraceEvents) ? end - kTraceEvents : 0;
+  char line[128];
+  int n = snprintf(line, sizeof(line),
+                   "# tcmalloc page heap trace: page_shift=%d events=%" LLU
+                   " lost=%" LLU "\n"
+                   "# time op heap page length sizeclass\n",
+                   static_cast<int>(kPageShift),
+                   static_cast<uint64_t>(end - start),
+                   static_cast<uint64_t>(start));
+  bool ok = (write(fd, line, n) == n);
+  for (uintptr_t i = start; ok && i < end; i++) {
+    const PageHeapEvent& e = trace_buffer[i & (kTraceEvents - 1)];
+    n = snprintf(line, sizeof(line), "%" LLU " %c %d %" LLU " %u %d\n",
+                 e.time, e.op, e.heap, e.page, e.length, e.sizeclass);
+    ok = (write(fd, line, n) == n);
+  }
+  close(fd);
+  return ok;
+}
+
+// Turn tracing on or off.  The buffer is allocated the first time
+// tracing is turned on and kept afterwards so that the events can
+// still be dumped.  Returns false if the buffer cannot be allocated.
+// REQUIRES: pageheap_lock is held
+static bool SetPageHeapTrace(bool enabled) {
+  if (enabled && trace_buffer == NULL) {
+    trace_buffer = reinterpret_cast<PageHeapEvent*>(
+        MetaDataAlloc(kTraceEvents * sizeof(PageHeapEvent)));
+    if (trace_buffer == NULL) return false;
+  }
+  pageheap_trace_enabled = enabled;
+  return true;
 }
 
 // -------------------------------------------------------------------------
@@ -503,11 +853,65 @@ static void DLL_InsertOrdered(Span* list, Span* span) {
   x->next = span;
 }
 
+// Sort "list" by start address.  This is a bottom-up merge sort on the
+// "next" links, since the list may be long, after which the "prev"
+// links are rebuilt.
+static void DLL_SortByAddress(Span* list) {
+  if (DLL_IsEmpty(list)) return;
+  list->prev->next = NULL;
+  Span* head = list->next;
+  for (int width = 1; ; width *= 2) {
+    Span* result = NULL;
+    Span** tail = &result;
+    int merges = 0;
+    Span* p = head;
+    while (p != NULL) {
+      // Merge the runs of "width" spans starting at "p" and "q"
+      merges++;
+      Span* q = p;
+      int psize = 0;
+      while (psize < width && q != NULL) {
+        q = q->next;
+        psize++;
+      }
+      int qsize = width;
+      while (psize > 0 || (qsize > 0 && q != NULL)) {
+        Span* next;
+        if (psize > 0 && (qsize == 0 || q == NULL || p->start <= q->start)) {
+          next = p;
+          p = p->next;
+          psize--;
+        } else {
+          next = q;
+          q = q->next;
+          qsize--;
+        }
+        *tail = next;
+        tail = &next->next;
+      }
+      p = q;
+    }
+    *tail = NULL;
+    head = result;
+    if (merges <= 1) break;
+  }
+  Span* prev = list;
+  for (Span* s = head; s != NULL; s = s->next) {
+    s->prev = prev;
+    prev = s;
+  }
+  prev->next = list;
+  list->prev = prev;
+  list->next = head;
+}
+
 // -------------------------------------------------------------------------
 // Stack traces kept for sampled allocations
-//   The following state is protected by pageheap_lock_.
+//   The following state is protected by sample_lock.
 // -------------------------------------------------------------------------
 
+static SpinLock sample_lock = SPINLOCK_INITIALIZER;
+
 static const int kMaxStackDepth = 31;
 struct StackTrace {
   uintptr_t size;          // Size of object
@@ -521,7 +925,16 @@ static Span sampled_objects;
 // Map from page-id to per-page data
 // -------------------------------------------------------------------------
 
-// We use PageMap1<> for 32-bit and PageMap3<> for 64-bit machines.
+// We use PageMap1<> for 32-bit machines, PageMap2<> for 64-bit machines
+// with 48-bit user addresses (or PageMapFlat<> if TCMALLOC_FLAT_PAGEMAP
+// is defined), and PageMap3<> for other 64-bit machines.
+
+// Number of significant bits in a user address
+#if defined __x86_64__ || defined __aarch64__
+static const int kAddressBits = 48;
+#else
+static const int kAddressBits = 8 * sizeof(void*);
+#endif
 
 // Selector class -- general selector uses 3-level map
 template <int BITS> class MapSelector {
@@ -529,6 +942,16 @@ template <int BITS> class MapSelector {
   typedef TCMalloc_PageMap3<BITS-kPageShift> Type;
 };
 
+// A two-level or flat map for 48-bit addresses
+template <> class MapSelector<48> {
+ public:
+#ifdef TCMALLOC_FLAT_PAGEMAP
+  typedef TCMalloc_PageMapFlat<48-kPageShift> Type;
+#else
+  typedef TCMalloc_PageMap2<48-kPageShift> Type;
+#endif
+};
+
 // A single-level map for 32-bit machines
 template <> class MapSelector<32> {
  public:
@@ -538,22 +961,122 @@ template <> class MapSelector<32> {
 // -------------------------------------------------------------------------
 // Page-level allocator
 //  * Eager coalescing
+//  * Best-fit by default; optionally lowest-address-first
 //
 // Heap for page-level allocation.  We allow allocating and freeing a
 // contiguous runs of pages (called a "span").
 // -------------------------------------------------------------------------
 
+// If true, page heaps hand out the lowest-addressed free span that is
+// large enough instead of the most recently freed one of the best size.
+// This keeps long-lived data packed at the bottom of the heap so that
+// the top stays free.  Exact-size free lists are kept sorted by address
+// while it is set, which makes freeing more expensive.  Lists that were
+// filled before it was set are sorted when it is set (see
+// SortFreeLists()).
+static volatile bool address_ordered_allocation = false;
+
+// If true, Delete() does not coalesce a freed span right away but keeps
+// it on a per-length list so that a following allocation of the same
+// length can take it back without a merge and a split.  Such spans are
+// coalesced when an allocation cannot otherwise be satisfied, when
+// they would exceed kMaxDeferredPages, and every
+// kDeferredCoalesceInterval deletes.  Not used together with
+// address_ordered_allocation, which wants freed spans to be merged and
+// reused from the bottom of the heap.  Such spans are marked with
+// kDeferredSpanClass (which must not be a valid size class) in
+// Span::sizeclass.
+static volatile bool deferred_coalescing = false;
+static const Length kMaxDeferredPages = 4 * kMaxPages;
+static const int kDeferredSpanClass = 254;
+static const int kDeferredCoalesceInterval = 4096;
+
+// Limits on the bytes that all page heap partitions together may get
+// from the system; 0 means no limit.  Memory the page heap gave back
+// does not count against heap_soft_limit.  Before the heap grows past
+// it, free page heap memory is given back to the system, and if that
+// is not enough the memory cached by threads as well (see
+// ReclaimForSoftLimit()); the heap still grows if that did not make
+// room.  The heap never grows past heap_hard_limit: the allocation
+// fails instead, and operator new calls the new_handler.
+static volatile size_t heap_soft_limit = 0;
+static volatile size_t heap_hard_limit = 0;
+
+// Bytes the partitions got from the system, bytes of free spans they
+// gave back and have not used again since, and how often growing the
+// heap ran into the limits.  Protected by heap_limit_lock.
+static SpinLock heap_limit_lock = SPINLOCK_INITIALIZER;
+static uint64_t heap_limit_bytes = 0;
+static uint64_t heap_released_bytes = 0;
+static uint64_t soft_limit_hits = 0;
+static uint64_t hard_limit_hits = 0;
+
+// Bytes by which growing the heap by "bytes" would take it past
+// heap_soft_limit, or 0
+static uint64_t SoftLimitExcess(uint64_t bytes) {
+  const uint64_t limit = heap_soft_limit;
+  if (limit == 0) return 0;
+  SpinLockHolder h(&heap_limit_lock);
+  const uint64_t total = heap_limit_bytes - heap_released_bytes + bytes;
+  return (total > limit) ? total - limit : 0;
+}
+
+// Count "n" pages of free spans as given back to the system if
+// "released", or else as used again
+static void CountReleasedPages(Length n, bool released) {
+  SpinLockHolder h(&heap_limit_lock);
+  if (released) {
+    heap_released_bytes += static_cast<uint64_t>(n) << kPageShift;
+  } else {
+    heap_released_bytes -= static_cast<uint64_t>(n) << kPageShift;
+  }
+}
+
+// Give back at least "bytes" bytes, or as much as we can: free page
+// heap memory first, then the memory cached by threads.  Defined with
+// the thread caches below.
+// REQUIRES: no lock is held
+static void ReclaimForSoftLimit(uint64_t bytes);
+
+// Pick the appropriate map type based on address size
+typedef MapSelector<kAddressBits>::Type PageMap;
+
+// Serializes growth of the pagemap shared by all partitions
+static SpinLock pagemap_lock = SPINLOCK_INITIALIZER;
+
 class TCMalloc_PageHeap {
  public:
-  TCMalloc_PageHeap();
+  // "pagemap" is shared by all partitions.  "index" identifies this
+  // partition.  "node" is the NUMA node whose memory it prefers, or -1
+  // if system memory should not be bound to a node.
+  TCMalloc_PageHeap(PageMap* pagemap, int index, int node);
+
+  // Lock -- exposed because caller grabs it before touching this object
+  SpinLock lock_;
 
   // Allocate a run of "n" pages.  Returns zero if out of memory.
+  // May temporarily release lock_ (see heap_soft_limit).
   Span* New(Length n);
 
-  // Delete the span "[p, p+n-1]".
+  // Delete the span "[p, p+n-1]".  Unless "release_interior" is
+  // false, the memory inside the free span it becomes part of may go
+  // back to the system (see ReleaseInterior()).
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
-  void Delete(Span* span);
+  void Delete(Span* span, bool release_interior = true);
+
+  // Coalesce all spans whose coalescing was deferred by Delete()
+  void CoalesceDeferred();
+
+  // Sort the exact-size free lists by address, as
+  // address_ordered_allocation expects them to be
+  void SortFreeLists();
+
+  // Give the memory of free spans back to the system, big spans
+  // first, until at least "n" pages went back.  Their pages stay in
+  // the heap and are faulted back in when used.  Returns the number
+  // of pages given back.
+  Length ReleaseFreeSpans(Length n);
 
   // Mark an allocated span as being used for small objects of the
   // specified size-class.
@@ -573,15 +1096,45 @@ class TCMalloc_PageHeap {
 
   // Return the descriptor for the specified page.
   inline Span* GetDescriptor(PageID p) const {
-    return reinterpret_cast<Span*>(pagemap_.get(p));
+    return reinterpret_cast<Span*>(pagemap_->get(p));
   }
 
   // Dump state to stderr
   void Dump(TCMalloc_Printer* out);
 
+  // Dump the sizes of the free spans and how fragmented they are
+  void DumpFragmentation(TCMalloc_Printer* out);
+
   // Return number of bytes allocated from system
   inline uint64_t SystemBytes() const { return system_bytes_; }
 
+  // Return number of span descriptors in use
+  inline int SpansInUse() const { return span_allocator_.inuse(); }
+
+  // Return the NUMA node this partition prefers, or -1
+  inline int node() const { return node_; }
+
+  // Return number of free bytes in the free spans that end at the
+  // highest address we got from the system, i.e., the memory that
+  // could be handed back by shrinking the heap.  Spans whose
+  // coalescing was deferred count as free.
+  uint64_t TopFreeBytes() const {
+    Length pages = 0;
+    for (PageID p = top_; p > 0; ) {
+      const Span* span = GetDescriptor(p - 1);
+      if (span == NULL || span->heap != index_) break;
+      if (!span->free && !IsDeferred(span)) break;
+      pages += span->length;
+      p = span->start;
+    }
+    return static_cast<uint64_t>(pages) << kPageShift;
+  }
+
+  // Return number of free bytes in spans whose coalescing was deferred
+  uint64_t DeferredBytes() const {
+    return static_cast<uint64_t>(deferred_pages_) << kPageShift;
+  }
+
   // Return number of free bytes in heap
   uint64_t FreeBytes() const {
     Length pages = 0;
@@ -591,16 +1144,21 @@ class TCMalloc_PageHeap {
     for (Span* s = large_.next; s != &large_; s = s->next) {
       pages += s->length;
     }
+    pages += deferred_pages_;
     return (static_cast<uint64_t>(pages) << kPageShift);
   }
 
   bool Check();
-  bool CheckList(Span* list, Length min_pages, Length max_pages);
+  bool CheckList(Span* list, Length min_pages, Length max_pages, bool free);
 
  private:
-  // Pick the appropriate map type based on pointer size
-  typedef MapSelector<8*sizeof(uintptr_t)>::Type PageMap;
-  PageMap pagemap_;
+  PageMap* pagemap_;
+
+  // Index of this partition; stored in Span::heap of every span we own
+  int index_;
+
+  // NUMA node to bind new system memory to, or -1
+  int node_;
 
   // List of free spans of length >= kMaxPages
   Span large_;
@@ -608,11 +1166,57 @@ class TCMalloc_PageHeap {
   // Array mapping from span length to a doubly linked list of free spans
   Span free_[kMaxPages];
 
+  // Array mapping from span length to a list of recently freed spans
+  // that have not been coalesced yet (see deferred_coalescing).
+  // These spans are not marked free.
+  Span deferred_[kMaxPages];
+  Length deferred_pages_;
+  int deletes_since_coalesce_;
+
   // Bytes allocated from system
   uint64_t system_bytes_;
 
+  // One past the highest page allocated from system
+  PageID top_;
+
+  // Descriptors for the spans we own.  Descriptors are never passed
+  // between partitions, so Span::heap of a descriptor never changes.
+  PageHeapAllocator<Span> span_allocator_;
+
   bool GrowHeap(Length n);
 
+  // Find a free span of at least "n" pages according to the current
+  // allocation policy, or NULL.
+  Span* FindFree(Length n);
+
+  // Find the free span of at least "n" pages with the lowest address,
+  // or NULL.  Used when address_ordered_allocation is set.
+  Span* FindLowest(Length n);
+
+  // Merge "span" with its free neighbors and put the result on the
+  // free lists
+  void Coalesce(Span* span, bool release_interior = true);
+
+  // Give the pagemap leaves that only cover the interior of free
+  // "span", and the memory of those pages, back to the system
+  void ReleaseInterior(Span* span);
+
+  // True if "span" is on one of the deferred_ lists
+  static bool IsDeferred(const Span* span) {
+    return span->sizeclass == kDeferredSpanClass;
+  }
+
+  // Put free "span" on the free list for its length
+  void LinkFree(Span* span) {
+    if (span->length >= kMaxPages) {
+      DLL_InsertOrdered(&large_, span);
+    } else if (address_ordered_allocation) {
+      DLL_InsertOrdered(&free_[span->length], span);
+    } else {
+      DLL_Prepend(&free_[span->length], span);
+    }
+  }
+
   // REQUIRES   span->length >= n
   // Remove span from its free list, and move any leftover part of
   // span into appropriate free lists.  Also update "span" to have
@@ -621,60 +1225,174 @@ class TCMalloc_PageHeap {
   void Carve(Span* span, Length n);
 
   void RecordSpan(Span* span) {
-    pagemap_.set(span->start, span);
+    pagemap_->set(span->start, span);
     if (span->length > 1) {
-      pagemap_.set(span->start + span->length - 1, span);
+      pagemap_->set(span->start + span->length - 1, span);
     }
   }
+
+  // Allocate/deallocate a descriptor for a span owned by this
+  // partition.  Other partitions may look at a recycled descriptor
+  // through a stale pagemap entry at any time, so "heap" must never
+  // be seen holding anything but our index.
+  Span* NewSpan(PageID p, Length len) {
+    Span* result = span_allocator_.New();
+    result->start = p;
+    result->length = len;
+    result->next = NULL;
+    result->prev = NULL;
+    result->objects = NULL;
+    result->free = 0;
+    result->sample = 0;
+    result->sizeclass = 0;
+    result->refcount = 0;
+    result->released = 0;
+    result->heap = index_;
+#ifdef SPAN_HISTORY
+    result->nexthistory = 0;
+#endif
+    return result;
+  }
+
+  void DeleteSpan(Span* span) {
+#ifndef NDEBUG
+    // In debug mode, trash the contents of deleted Spans (but not the
+    // bit fields, see above)
+    memset(&span->length, 0x3f,
+           offsetof(Span, prev) + sizeof(span->prev) - offsetof(Span, length));
+#endif
+    span_allocator_.Delete(span);
+  }
+
+  // Is "neighbor" a free span we may coalesce with?
+  bool CanMerge(const Span* neighbor) const {
+    return neighbor != NULL && neighbor->free && neighbor->heap == index_;
+  }
 };
 
-TCMalloc_PageHeap::TCMalloc_PageHeap() : pagemap_(MetaDataAlloc),
-                                         system_bytes_(0) {
+TCMalloc_PageHeap::TCMalloc_PageHeap(PageMap* pagemap, int index, int node)
+  : pagemap_(pagemap),
+    index_(index),
+    node_(node),
+    deferred_pages_(0),
+    deletes_since_coalesce_(0),
+    system_bytes_(0),
+    top_(0) {
+  lock_.Init();
+  span_allocator_.Init();
   DLL_Init(&large_);
   for (int i = 0; i < kMaxPages; i++) {
     DLL_Init(&free_[i]);
+    DLL_Init(&deferred_[i]);
   }
 }
 
 Span* TCMalloc_PageHeap::New(Length n) {
   ASSERT(Check());
   if (n == 0) n = 1;
+  if (n > kMaxSpanLength) return NULL;
+
+  // A recently freed span of exactly the right length needs neither
+  // coalescing nor splitting
+  if (n < kMaxPages && !DLL_IsEmpty(&deferred_[n])) {
+    Span* result = deferred_[n].next;
+    DLL_Remove(result);
+    result->sizeclass = 0;
+    deferred_pages_ -= n;
+    Event(result, 'a', n);
+    TracePageHeap(kTraceReuse, index_, result->start, n);
+    ASSERT(Check());
+    return result;
+  }
 
-  // Find first size >= n that has a non-empty list
-  for (int s = n; s < kMaxPages; s++) {
-    if (!DLL_IsEmpty(&free_[s])) {
-      Span* result = free_[s].next;
-      Carve(result, n);
+  Span* result = FindFree(n);
+  if (result == NULL && deferred_pages_ > 0) {
+    // Coalesce the spans we have been holding back before growing
+    CoalesceDeferred();
+    result = FindFree(n);
+  }
+  if (result == NULL) {
+    const Length grow = (n > kMinSystemAlloc) ? n : kMinSystemAlloc;
+    const uint64_t excess =
+        SoftLimitExcess(static_cast<uint64_t>(grow) << kPageShift);
+    if (excess > 0) {
+      // Make room before growing past the soft limit.  Other threads
+      // may allocate from this partition in the meantime.
+      lock_.Unlock();
+      ReclaimForSoftLimit(excess);
+      lock_.Lock();
+      if (deferred_pages_ > 0) CoalesceDeferred();
+      result = FindFree(n);
+    }
+  }
+  if (result == NULL) {
+    // Nothing suitable.  Grow the heap and look again.
+    if (!GrowHeap(n)) {
       ASSERT(Check());
-      return result;
+      return NULL;
     }
+    result = FindFree(n);
   }
+  if (result != NULL && result->released) {
+    // The pages we hand out and the first page of the leftover need
+    // their pagemap entries back
+    SpinLockHolder h(&pagemap_lock);
+    if (!pagemap_->Ensure(result->start, n + 1)) {
+      ASSERT(Check());
+      return NULL;
+    }
+  }
+  if (result != NULL) {
+    Carve(result, n);
+    TracePageHeap(kTraceNew, index_, result->start, n);
+  }
+  ASSERT(Check());
+  return result;
+}
 
-  // Look in large list.  If we first do not find something, we try to
-  // grow the heap and try again.
-  for (int i = 0; i < 2; i++) {
-    // find the best span (closest to n in size)
-    Span *best = NULL;
-    for (Span* span = large_.next; span != &large_; span = span->next) {
-      if (span->length >= n &&
-          (best == NULL || span->length < best->length)) {
-        best = span;
-      }
+Span* TCMalloc_PageHeap::FindFree(Length n) {
+  if (address_ordered_allocation) return FindLowest(n);
+
+  // Find first size >= n that has a non-empty list
+  for (Length s = n; s < kMaxPages; s++) {
+    if (!DLL_IsEmpty(&free_[s])) return free_[s].next;
+  }
+
+  // Look in large list: find the best span (closest to n in size)
+  Span *best = NULL;
+  for (Span* span = large_.next; span != &large_; span = span->next) {
+    if (span->length >= n &&
+        (best == NULL || span->length < best->length)) {
+      best = span;
     }
-    if (best != NULL) {
-      Carve(best, n);
-      ASSERT(Check());
-      return best;
+  }
+  return best;
+}
+
+void TCMalloc_PageHeap::SortFreeLists() {
+  for (Length s = 1; s < kMaxPages; s++) DLL_SortByAddress(&free_[s]);
+  ASSERT(Check());
+}
+
+Span* TCMalloc_PageHeap::FindLowest(Length n) {
+  // Each exact-size list is sorted by address, so only its head can be
+  // the lowest span of that size.
+  Span* lowest = NULL;
+  for (Length s = n; s < kMaxPages; s++) {
+    Span* span = free_[s].next;
+    if (span != &free_[s] && (lowest == NULL || span->start < lowest->start)) {
+      lowest = span;
     }
-    if (i == 0) {
-      // Nothing suitable in large list.  Grow the heap and look again.
-      if (!GrowHeap(n)) {
-        ASSERT(Check());
-        return NULL;
-      }
+  }
+  // The large list is always sorted by address
+  for (Span* span = large_.next; span != &large_; span = span->next) {
+    if (lowest != NULL && span->start > lowest->start) break;
+    if (span->length >= n) {
+      lowest = span;
+      break;
     }
   }
-  return NULL;
+  return lowest;
 }
 
 Span* TCMalloc_PageHeap::Split(Span* span, Length n) {
@@ -688,8 +1406,9 @@ Span* TCMalloc_PageHeap::Split(Span* span, Length n) {
   Span* leftover = NewSpan(span->start + n, extra);
   Event(leftover, 'U', extra);
   RecordSpan(leftover);
-  pagemap_.set(span->start + n - 1, span); // Update map from pageid to span
+  pagemap_->set(span->start + n - 1, span); // Update map from pageid to span
   span->length = n;
+  TracePageHeap(kTraceSplit, index_, span->start, n);
 
   return leftover;
 }
@@ -705,77 +1424,168 @@ void TCMalloc_PageHeap::Carve(Span* span, Length n) {
   if (extra > 0) {
     Span* leftover = NewSpan(span->start + n, extra);
     leftover->free = 1;
+    leftover->released = span->released;
+    // We do not know which pages were given back, so the ones we hand
+    // out are taken to be those
+    if (span->released_pages > n) {
+      leftover->released_pages = span->released_pages - n;
+      span->released_pages = n;
+    }
     Event(leftover, 'S', extra);
+    TracePageHeap(kTraceLeftover, index_, leftover->start, extra);
     RecordSpan(leftover);
-    if (extra < kMaxPages) {
-      DLL_Prepend(&free_[extra], leftover);
-    } else {
-      DLL_InsertOrdered(&large_, leftover);
-    }
+    LinkFree(leftover);
     span->length = n;
-    pagemap_.set(span->start + n - 1, span);
+    pagemap_->set(span->start + n - 1, span);
   }
+  if (span->released_pages > 0) CountReleasedPages(span->released_pages, false);
+  span->released_pages = 0;
+  span->released = 0;
 }
 
-void TCMalloc_PageHeap::Delete(Span* span) {
+void TCMalloc_PageHeap::Delete(Span* span, bool release_interior) {
   ASSERT(Check());
   ASSERT(!span->free);
+  ASSERT(span->heap == index_);
   ASSERT(span->length > 0);
   ASSERT(GetDescriptor(span->start) == span);
   ASSERT(GetDescriptor(span->start + span->length - 1) == span);
+  if (span->sizeclass != 0) {
+    // The pages may be handed out as a page-level span next
+    for (Length i = 0; i < span->length; i++) {
+      pagemap_->set_sizeclass(span->start+i, 0);
+    }
+  }
   span->sizeclass = 0;
   span->sample = 0;
+  span->released = 0;
+  span->released_pages = 0;     // Was the list of free objects
+  TracePageHeap(kTraceDelete, index_, span->start, span->length);
+
+  if (deferred_coalescing && !address_ordered_allocation &&
+      span->length < kMaxPages &&
+      deferred_pages_ + span->length <= kMaxDeferredPages) {
+    // Keep the span as it is for an allocation of the same length.
+    // It stays marked as in use so that neighbors do not merge with it.
+    Event(span, 'd', span->length);
+    TracePageHeap(kTraceDefer, index_, span->start, span->length);
+    span->sizeclass = kDeferredSpanClass;
+    DLL_Prepend(&deferred_[span->length], span);
+    deferred_pages_ += span->length;
+    if (++deletes_since_coalesce_ >= kDeferredCoalesceInterval) {
+      CoalesceDeferred();
+    }
+    ASSERT(Check());
+    return;
+  }
+  Coalesce(span, release_interior);
+}
 
+void TCMalloc_PageHeap::CoalesceDeferred() {
+  deletes_since_coalesce_ = 0;
+  if (deferred_pages_ == 0) return;
+  for (Length s = 1; s < kMaxPages; s++) {
+    while (!DLL_IsEmpty(&deferred_[s])) {
+      Span* span = deferred_[s].next;
+      DLL_Remove(span);
+      span->sizeclass = 0;
+      deferred_pages_ -= s;
+      Coalesce(span);
+    }
+  }
+  ASSERT(deferred_pages_ == 0);
+}
+
+void TCMalloc_PageHeap::Coalesce(Span* span, bool release_interior) {
   // Coalesce -- we guarantee that "p" != 0, so no bounds checking
   // necessary.  We do not bother resetting the stale pagemap
   // entries for the pieces we are merging together because we only
-  // care about the pagemap entries for the boundaries.
+  // care about the pagemap entries for the boundaries.  Neighbors
+  // owned by other partitions are left alone.
   const PageID p = span->start;
   const Length n = span->length;
   Span* prev = GetDescriptor(p-1);
-  if (prev != NULL && prev->free) {
+  if (CanMerge(prev)) {
     // Merge preceding span into this span
     ASSERT(prev->start + prev->length == p);
     const Length len = prev->length;
     DLL_Remove(prev);
+    if (prev->released) span->released = 1;
+    span->released_pages += prev->released_pages;
     DeleteSpan(prev);
     span->start -= len;
     span->length += len;
-    pagemap_.set(span->start, span);
+    pagemap_->set(span->start, span);
     Event(span, 'L', len);
   }
   Span* next = GetDescriptor(p+n);
-  if (next != NULL && next->free) {
+  if (CanMerge(next)) {
     // Merge next span into this span
     ASSERT(next->start == p+n);
     const Length len = next->length;
     DLL_Remove(next);
+    if (next->released) span->released = 1;
+    span->released_pages += next->released_pages;
     DeleteSpan(next);
     span->length += len;
-    pagemap_.set(span->start + span->length - 1, span);
+    pagemap_->set(span->start + span->length - 1, span);
     Event(span, 'R', len);
   }
 
   Event(span, 'D', span->length);
   span->free = 1;
-  if (span->length < kMaxPages) {
-    DLL_Prepend(&free_[span->length], span);
-  } else {
-    DLL_InsertOrdered(&large_, span);
+  LinkFree(span);
+  TracePageHeap(kTraceFree, index_, span->start, span->length);
+  if (release_interior && PageMap::RELEASE_LENGTH > 0 &&
+      span->length > PageMap::RELEASE_LENGTH + 1) {
+    ReleaseInterior(span);
   }
 
   ASSERT(Check());
 }
 
+void TCMalloc_PageHeap::ReleaseInterior(Span* span) {
+  // Only the entries for the first and last page of a free span are
+  // ever looked at, so the pagemap can drop every leaf that lies in
+  // between.  A page whose entry is gone may not be used before New()
+  // has ensured it again, which is why its memory goes back as well.
+  PageID lo, hi;
+  bool released;
+  {
+    SpinLockHolder h(&pagemap_lock);
+    released = pagemap_->Release(span->start + 1, span->length - 2, &lo, &hi);
+  }
+  if (released) {
+    TCMalloc_SystemRelease(reinterpret_cast<void*>(lo << kPageShift),
+                           (hi - lo) << kPageShift);
+    span->released = 1;
+    // Some of these pages may have been counted already, by an earlier
+    // release of a span merged into this one; never count more pages
+    // than the span has
+    Length n = hi - lo;
+    if (n > span->length - span->released_pages) {
+      n = span->length - span->released_pages;
+    }
+    if (n > 0) {
+      span->released_pages += n;
+      CountReleasedPages(n, true);
+    }
+  }
+}
+
 void TCMalloc_PageHeap::RegisterSizeClass(Span* span, size_t sc) {
   // Associate span object with all interior pages as well
   ASSERT(!span->free);
   ASSERT(GetDescriptor(span->start) == span);
   ASSERT(GetDescriptor(span->start+span->length-1) == span);
   Event(span, 'C', sc);
+  TracePageHeap(kTraceClass, index_, span->start, span->length, sc);
   span->sizeclass = sc;
   for (Length i = 1; i < span->length-1; i++) {
-    pagemap_.set(span->start+i, span);
+    pagemap_->set(span->start+i, span);
+  }
+  for (Length i = 0; i < span->length; i++) {
+    pagemap_->set_sizeclass(span->start+i, sc);
   }
 }
 
@@ -803,7 +1613,7 @@ void TCMalloc_PageHeap::Dump(TCMalloc_Printer* out) {
   uint64_t large_pages = 0;
   int large_spans = 0;
   for (Span* s = large_.next; s != &large_; s = s->next) {
-    out->printf("   [ %6" PRIuS " spans ]\n", s->length);
+    out->printf("   [ %6" PRIuS " spans ]\n", static_cast<size_t>(s->length));
     large_pages += s->length;
     large_spans++;
   }
@@ -812,33 +1622,123 @@ void TCMalloc_PageHeap::Dump(TCMalloc_Printer* out) {
               large_spans,
               (large_pages << kPageShift) / 1048576.0,
               (cumulative << kPageShift) / 1048576.0);
+  out->printf("Free at top of heap: %6.1f MB\n",
+              TopFreeBytes() / 1048576.0);
+  out->printf("Not yet coalesced:   %6.1f MB\n",
+              (static_cast<uint64_t>(deferred_pages_) << kPageShift) / 1048576.0);
+}
+
+void TCMalloc_PageHeap::DumpFragmentation(TCMalloc_Printer* out) {
+  // Free spans by length: 1, 2-3, 4-7, ..., 128-255 and >255 pages
+  static const int kBuckets = 9;
+  int spans[kBuckets];
+  uint64_t pages[kBuckets];
+  for (int b = 0; b < kBuckets; b++) {
+    spans[b] = 0;
+    pages[b] = 0;
+  }
+  uint64_t total = 0;
+  Length largest = 0;
+  // The free lists, "large_" and then the deferred lists, whose spans
+  // are free memory as well
+  for (Length length = 1; length <= 2 * kMaxPages - 1; length++) {
+    Span* list = (length == kMaxPages) ? &large_
+                 : (length < kMaxPages) ? &free_[length]
+                 : &deferred_[length - kMaxPages];
+    for (Span* s = list->next; s != list; s = s->next) {
+      int b = 0;
+      while (b < kBuckets - 1 && (Length(2) << b) <= s->length) b++;
+      spans[b]++;
+      pages[b] += s->length;
+      total += s->length;
+      if (s->length > largest) largest = s->length;
+    }
+  }
+
+  // External fragmentation index: the fraction of free memory that is
+  // not in the largest free span, i.e., that cannot satisfy the
+  // largest request we could serve without growing the heap.
+  out->printf("Largest free span:   %6.1f MB; fragmentation index %.3f\n",
+              (static_cast<uint64_t>(largest) << kPageShift) / 1048576.0,
+              (total > 0) ? 1.0 - static_cast<double>(largest) / total : 0.0);
+  for (int b = 0; b < kBuckets; b++) {
+    if (spans[b] == 0) continue;
+    if (b == kBuckets - 1) {
+      out->printf("  >%-8d pages: %6d free spans ~ %6.1f MB\n",
+                  (1 << b) - 1, spans[b], (pages[b] << kPageShift) / 1048576.0);
+    } else {
+      out->printf("  %3d - %3d pages: %6d free spans ~ %6.1f MB\n",
+                  1 << b, (2 << b) - 1, spans[b],
+                  (pages[b] << kPageShift) / 1048576.0);
+    }
+  }
+}
+
+// Count growing the heap by "*ask" pages, or by just "n" if "*ask"
+// would take it past heap_hard_limit.  Returns false if even "n" would.
+static bool ReserveHeapPages(Length n, Length* ask) {
+  const uint64_t limit = heap_hard_limit;
+  SpinLockHolder h(&heap_limit_lock);
+  if (limit != 0 &&
+      heap_limit_bytes + (static_cast<uint64_t>(*ask) << kPageShift) > limit) {
+    if (heap_limit_bytes + (static_cast<uint64_t>(n) << kPageShift) > limit) {
+      hard_limit_hits++;
+      return false;
+    }
+    *ask = n;
+  }
+  heap_limit_bytes += static_cast<uint64_t>(*ask) << kPageShift;
+  return true;
+}
+
+// Undo ReserveHeapPages() for "n" pages the system did not give us
+static void UnreserveHeapPages(Length n) {
+  SpinLockHolder h(&heap_limit_lock);
+  heap_limit_bytes -= static_cast<uint64_t>(n) << kPageShift;
 }
 
 bool TCMalloc_PageHeap::GrowHeap(Length n) {
   ASSERT(kMaxPages >= kMinSystemAlloc);
   Length ask = (n>kMinSystemAlloc) ? n : static_cast<Length>(kMinSystemAlloc);
+  if (!ReserveHeapPages(n, &ask)) return false;
   void* ptr = TCMalloc_SystemAlloc(ask << kPageShift, kPageSize);
   if (ptr == NULL) {
     if (n < ask) {
       // Try growing just "n" pages
+      UnreserveHeapPages(ask - n);
       ask = n;
       ptr = TCMalloc_SystemAlloc(ask << kPageShift, kPageSize);
     }
-    if (ptr == NULL) return false;
+    if (ptr == NULL) {
+      UnreserveHeapPages(ask);
+      return false;
+    }
   }
+  if (node_ >= 0) {
+    // Failure is harmless: the kernel just uses its default policy
+    TCMalloc_BindToNumaNode(ptr, ask << kPageShift, node_);
+  }
+  AdviseHugePages(ptr, ask << kPageShift, heap_huge_pages);
   system_bytes_ += (ask << kPageShift);
   const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
   ASSERT(p > 0);
+  if (p + ask > top_) top_ = p + ask;
+  TracePageHeap(kTraceGrow, index_, p, ask);
   
   // Make sure pagemap_ has entries for all of the new pages.
   // Plus ensure one before and one after so coalescing code
   // does not need bounds-checking.
-  if (pagemap_.Ensure(p-1, ask+2)) {
+  bool ok;
+  {
+    SpinLockHolder h(&pagemap_lock);
+    ok = pagemap_->Ensure(p-1, ask+2);
+  }
+  if (ok) {
     // Pretend the new area is allocated and then Delete() it to
     // cause any necessary coalescing to occur.
     Span* span = NewSpan(p, ask);
     RecordSpan(span);
-    Delete(span);
+    Coalesce(span);
     ASSERT(Check());
     return true;
   } else {
@@ -848,18 +1748,43 @@ bool TCMalloc_PageHeap::GrowHeap(Length n) {
   }
 }
 
+Length TCMalloc_PageHeap::ReleaseFreeSpans(Length n) {
+  if (deferred_pages_ > 0) CoalesceDeferred();
+  // Spans marked released may still have pages that were not (see
+  // ReleaseInterior()), so only those counted as released all along
+  // are skipped
+  Length released = 0;
+  for (Length s = kMaxPages; s >= 1 && released < n; s--) {
+    Span* list = (s < kMaxPages) ? &free_[s] : &large_;
+    for (Span* span = list->next; span != list && released < n;
+         span = span->next) {
+      if (span->released_pages == span->length) continue;
+      TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
+                             static_cast<size_t>(span->length) << kPageShift);
+      released += span->length - span->released_pages;
+      span->released_pages = span->length;
+      span->released = 1;
+    }
+  }
+  if (released > 0) CountReleasedPages(released, true);
+  return released;
+}
+
 bool TCMalloc_PageHeap::Check() {
   ASSERT(free_[0].next == &free_[0]);
-  CheckList(&large_, kMaxPages, 1000000000);
+  CheckList(&large_, kMaxPages, 1000000000, true);
   for (Length s = 1; s < kMaxPages; s++) {
-    CheckList(&free_[s], s, s);
+    CheckList(&free_[s], s, s, true);
+    CheckList(&deferred_[s], s, s, false);
   }
   return true;
 }
 
-bool TCMalloc_PageHeap::CheckList(Span* list, Length min_pages, Length max_pages) {
+bool TCMalloc_PageHeap::CheckList(Span* list, Length min_pages, Length max_pages,
+                                  bool free) {
   for (Span* s = list->next; s != list; s = s->next) {
-    CHECK_CONDITION(s->free);
+    CHECK_CONDITION(s->free == free);
+    CHECK_CONDITION(IsDeferred(s) == !free);
     CHECK_CONDITION(s->length >= min_pages);
     CHECK_CONDITION(s->length <= max_pages);
     CHECK_CONDITION(GetDescriptor(s->start) == s);
@@ -915,6 +1840,55 @@ class TCMalloc_ThreadCache_FreeList {
   }
 };
 
+//-------------------------------------------------------------------
+// Histogram of requested allocation sizes
+//-------------------------------------------------------------------
+
+// While "tcmalloc.size_histogram" is set, every thread counts the sizes
+// passed to malloc() in a histogram of its own, so recording takes no
+// lock.  Sizes up to kMaxSize are counted in the steps of the size
+// class lookup tables, so all sizes in a bucket share one size class;
+// bigger sizes are counted by power of two.
+static const int kHistogramSmallBuckets = (kMaxSmallSize >> kAlignShift) + 1;
+static const int kHistogramMediumBuckets =
+    (kMaxSize - kMaxSmallSize) >> kLargeSizeShift;
+static const int kHistogramLargeBuckets = 8 * sizeof(size_t) - 20;
+static const int kHistogramBuckets =
+    kHistogramSmallBuckets + kHistogramMediumBuckets + kHistogramLargeBuckets;
+
+struct SizeHistogram {
+  uint64_t count[kHistogramBuckets];    // Allocations per bucket
+  uint64_t bytes[kHistogramBuckets];    // Sum of their requested sizes
+  int      generation;                  // size_histogram_generation when
+                                        // the counts were last cleared
+};
+
+static inline int HistogramBucket(size_t size) {
+  if (size <= kMaxSmallSize) {
+    return (size + kAlignment - 1) >> kAlignShift;
+  }
+  if (size <= kMaxSize) {
+    const size_t step = 1 << kLargeSizeShift;
+    return kHistogramSmallBuckets - 1 +
+           ((size - kMaxSmallSize + step - 1) >> kLargeSizeShift);
+  }
+  // Bucket "b" holds the sizes in (kMaxSize << b, kMaxSize << (b+1)]
+  int b = 0;
+  for (size_t s = (size - 1) / kMaxSize; s > 1; s >>= 1) b++;
+  if (b >= kHistogramLargeBuckets) b = kHistogramLargeBuckets - 1;
+  return kHistogramSmallBuckets + kHistogramMediumBuckets + b;
+}
+
+// Largest size counted in bucket "b"
+static inline size_t HistogramBucketSize(int b) {
+  if (b < kHistogramSmallBuckets) return b << kAlignShift;
+  b -= kHistogramSmallBuckets;
+  if (b < kHistogramMediumBuckets) {
+    return kMaxSmallSize + (static_cast<size_t>(b + 1) << kLargeSizeShift);
+  }
+  return kMaxSize << (b - kHistogramMediumBuckets + 1);
+}
+
 //-------------------------------------------------------------------
 // Data kept per thread
 //-------------------------------------------------------------------
@@ -928,10 +1902,28 @@ class TCMalloc_ThreadCache {
   bool          setspecific_;           // Called pthread_setspecific?
   FreeList      list_[kNumClasses];     // Array indexed by size-class
 
+  // Recently freed page-level spans, indexed by length in pages.  The
+  // lists link the first word of each span's memory, exactly like the
+  // small-object lists.  Spans in here are still allocated as far as
+  // the page heap is concerned.
+  size_t        large_size_;            // Combined size of large_
+  FreeList      large_[kMaxCachedLargePages+1];
+  uint64_t      large_hits_;            // Allocations served from large_
+  uint64_t      large_evictions_;       // Spans handed back to page heap
+
   // We sample allocations, biased by the size of the allocation
   uint32_t      rnd_;                   // Cheap random number generator
   size_t        bytes_until_sample_;    // Bytes until we sample next
 
+  // Requested sizes, allocated when the first one is recorded
+  SizeHistogram* histogram_;
+
+  // Value of cache_flush_generation when we last flushed
+  int           flush_generation_;
+
+  // Allocate "histogram_", or clear it for a new recording
+  void ResetHistogram();
+
  public:
   // All ThreadCache objects are kept in a linked list (for stats collection)
   TCMalloc_ThreadCache* next_;
@@ -940,15 +1932,46 @@ class TCMalloc_ThreadCache {
   void Init(pthread_t tid);
   void Cleanup();
 
+  // Give all cached objects and page-level spans back, and remember
+  // that we did so (see cache_flush_generation)
+  void Flush();
+
   // Accessors (mostly just for printing stats)
   int freelist_length(size_t cl) const { return list_[cl].length(); }
 
   // Total byte size in cache
   size_t Size() const { return size_; }
 
+  // Stats for the cache of page-level spans
+  size_t LargeSize() const { return large_size_; }
+  uint64_t large_hits() const { return large_hits_; }
+  uint64_t large_evictions() const { return large_evictions_; }
+
+  // Histogram of requested sizes; NULL if none were recorded
+  SizeHistogram* histogram() const { return histogram_; }
+  SizeHistogram* TakeHistogram() {
+    SizeHistogram* h = histogram_;
+    histogram_ = NULL;
+    return h;
+  }
+
+  // Count a request for "size" bytes in the size histogram
+  void RecordSize(size_t size);
+
   void* Allocate(size_t size);
   void Deallocate(void* ptr, size_t size_class);
 
+  // Return a cached span of exactly "n" pages, or NULL if there is none.
+  void* AllocateLarge(Length n);
+
+  // Try to cache the page-level "span" instead of returning it to the
+  // page heap.  Returns false if the span is not cacheable.
+  bool DeallocateLarge(Span* span);
+
+  // Hand cached page-level spans back to the page heap until at most
+  // "target" bytes remain cached.
+  void ReleaseLargeSpans(size_t target);
+
   void FetchFromCentralCache(size_t cl);
   void ReleaseToCentralCache(size_t cl, int N);
   void Scavenge();
@@ -974,6 +1997,10 @@ class TCMalloc_ThreadCache {
 // Data kept per size-class in central cache
 //-------------------------------------------------------------------
 
+// Number of buckets of equal width that central cache spans are
+// counted in by how many of their objects are in use
+static const int kOccupancyBuckets = 4;
+
 class TCMalloc_Central_FreeList {
  public:
   void Init(size_t cl);
@@ -997,6 +2024,23 @@ class TCMalloc_Central_FreeList {
   // Number of free objects in cache
   int length() const { return counter_; }
 
+  // REQUIRES: lock_ is held
+  // Number of bytes given back to the system from inside our spans
+  size_t released_bytes() const { return released_bytes_; }
+
+  // REQUIRES: lock_ is held
+  // Number of pages in the next span fetched from the page heap
+  Length span_pages() const {
+    return span_scale_ * class_to_pages[size_class_];
+  }
+
+  // REQUIRES: lock_ is held
+  // Count our spans into "occupancy" by the fraction of their objects
+  // that are in use (by the application or in thread caches).  Spans
+  // with all objects in use are counted in the extra last bucket.
+  // Returns the number of spans.
+  int SpanOccupancy(int occupancy[kOccupancyBuckets + 1]);
+
   // Lock -- exposed because caller grabs it before touching this object
   SpinLock lock_;
 
@@ -1006,6 +2050,25 @@ class TCMalloc_Central_FreeList {
   Span     empty_;          // Dummy header for list of empty spans
   Span     nonempty_;       // Dummy header for list of non-empty spans
   size_t   counter_;        // Number of free objects in cache entry
+  size_t   released_bytes_; // Bytes released by ReleaseFreePages()
+
+  // Spans are fetched with span_scale_ times class_to_pages[] pages.
+  // Multiples of class_to_pages[] keep the leftover at the end of a
+  // span within the same bound.
+  int      span_scale_;
+  int      spans_fetched_;  // Since span_scale_ was last reconsidered
+  int      spans_returned_; // Ditto
+
+  // Reconsider span_scale_ before fetching a span (see
+  // adaptive_span_pages).
+  void AdjustSpanScale();
+
+  // Give the pages of "span" that hold nothing but free objects back
+  // to the system (see release_span_pages).
+  void ReleaseFreePages(Span* span);
+
+  // Number of objects of "span" that start on a released page
+  int ReleasedObjects(const Span* span) const;
 };
 
 // Pad each CentralCache object to multiple of 64 bytes
@@ -1022,10 +2085,103 @@ class TCMalloc_Central_FreeListPadded : public TCMalloc_Central_FreeList {
 // We have a separate lock per free-list to reduce contention.
 static TCMalloc_Central_FreeListPadded central_cache[kNumClasses];
 
-// Page-level allocator
+// Page-level allocator.  There is one partition per NUMA node and
+// shard in use; shard "s" of node slot "n" is "pageheaps[s*kMaxNumaNodes
+// + n]", so the node a partition is bound to does not depend on the
+// number of shards.  "pageheaps[0]" always exists and is the only one
+// in use by default.  Other partitions are created on first use under
+// pageheap_lock and are never destroyed.
 static SpinLock pageheap_lock = SPINLOCK_INITIALIZER;
-static TCMalloc_PageHeap* pageheap = NULL;
-static char pageheap_memory[sizeof(TCMalloc_PageHeap)];
+static TCMalloc_PageHeap* volatile pageheaps[kMaxPageHeaps];
+static char pageheap_memory[kMaxPageHeaps][sizeof(TCMalloc_PageHeap)];
+
+// Number of node slots and shards per node that new allocations are
+// routed to.  Writes are protected by pageheap_lock.  Partitions beyond
+// these counts may still own spans, and frees always go to the owning
+// partition.
+static volatile int num_pageheaps = 1;
+static volatile int num_pageheap_shards = 1;
+
+// Map from page-id to descriptor, shared by all partitions
+static PageMap* pagemap = NULL;
+static char pagemap_memory[sizeof(PageMap)];
+
+static inline Span* GetDescriptor(PageID p) {
+  return reinterpret_cast<Span*>(pagemap->get(p));
+}
+
+// Size class of the objects on page "p", or 0 for a page-level span.
+// Cheaper than looking at the span descriptor.
+static inline size_t GetSizeClass(PageID p) {
+  return pagemap->sizeclass(p);
+}
+
+// If true, the central cache gives pages inside its spans that hold
+// only free objects back to the system.  The objects that start on such
+// a page are taken out of circulation until the whole span is free.
+// Their pages are marked with kReleasedPageClass (which must not be a
+// valid size class) in the pagemap.
+static volatile bool release_span_pages = false;
+static const int kReleasedPageClass = 255;
+
+// If true, the number of pages the central cache fetches per span of a
+// size class grows while the class keeps fetching spans and none come
+// back, and shrinks back towards class_to_pages[] as spans are given
+// back.  Hot classes then go to the page heap less often, while classes
+// whose spans do not fill up stay at the smallest span that bounds the
+// leftover at the end of a span.
+static volatile bool adaptive_span_pages = false;
+
+// The partition that owns "span"
+static inline TCMalloc_PageHeap* OwningPageHeap(const Span* span) {
+  return pageheaps[span->heap];
+}
+
+// Give "span" back to the partition that owns it
+static void ReturnToPageHeap(Span* span) {
+  TCMalloc_PageHeap* heap = OwningPageHeap(span);
+  SpinLockHolder h(&heap->lock_);
+  heap->Delete(span);
+}
+
+static TCMalloc_PageHeap* CreatePageHeap(int index);
+
+// Cheap hash that differs between threads: their stacks are at least
+// 64KB apart.
+static inline uint32_t ThreadHash(const void* stack_address) {
+  const uint32_t sp = reinterpret_cast<uintptr_t>(stack_address) >> 16;
+  return (sp * 2654435761u) >> 16;
+}
+
+// The partition to allocate from for the calling thread
+static TCMalloc_PageHeap* LocalPageHeap() {
+  const int n = num_pageheaps;
+  const int shards = num_pageheap_shards;
+  if (n == 1 && shards == 1) return pageheaps[0];
+  int cpu, node;
+  TCMalloc_GetCpuAndNode(&cpu, &node);
+
+  int slot = 0;
+  if (n <= TCMalloc_NumaNodeCount()) {
+    slot = node % n;
+  } else {
+    // More partitions than real nodes, e.g., when exercising the
+    // partitioning on a single-node machine.  Spread threads across
+    // partitions by cpu and by their stack address.
+    slot = (cpu + ThreadHash(&cpu)) % n;
+  }
+
+  // Threads running at the same time are on different cpus, so picking
+  // the shard by cpu keeps them apart.  With more shards than cpus
+  // spread threads by stack address as well.
+  uint32_t key = cpu;
+  if (shards > TCMalloc_NumCPUs()) key += ThreadHash(&cpu) / n;
+  const int index = (key % shards) * kMaxNumaNodes + slot;
+
+  TCMalloc_PageHeap* heap = pageheaps[index];
+  if (heap == NULL) heap = CreatePageHeap(index);
+  return heap;
+}
 
 // Thread-specific key.  Initialization here is somewhat tricky
 // because some Linux startup code invokes malloc() before it
@@ -1035,22 +2191,94 @@ static char pageheap_memory[sizeof(TCMalloc_PageHeap)];
 static bool tsd_inited = false;
 static pthread_key_t heap_key;
 
-// Allocator for thread heaps
+// Protects the thread heap registry and cache size budget below
+static SpinLock threadheap_lock = SPINLOCK_INITIALIZER;
+
+// Allocator for thread heaps.  Protected by threadheap_lock.
 static PageHeapAllocator<TCMalloc_ThreadCache> threadheap_allocator;
 
-// Linked list of heap objects.  Protected by pageheap_lock.
+// Linked list of heap objects.  Protected by threadheap_lock.
 static TCMalloc_ThreadCache* thread_heaps = NULL;
 static int thread_heap_count = 0;
 
-// Overall thread cache size.  Protected by pageheap_lock.
+// Overall thread cache size.  Protected by threadheap_lock.
 static size_t overall_thread_cache_size = kDefaultOverallThreadCacheSize;
 
+// Large span cache counters of threads that have exited.  Protected
+// by threadheap_lock.
+static uint64_t dead_thread_span_hits = 0;
+static uint64_t dead_thread_span_evicts = 0;
+
+// Size histograms.  Threads record into their own histogram without
+// locking; the allocator, the histogram of threads that have exited
+// and the reading of other threads' histograms are protected by
+// threadheap_lock.  Reads may miss increments that are in flight.
+// histogram_allocator is never Init()ed: its zeroed state is valid,
+// and Init() would carve two histograms that may never be used.
+static volatile bool size_histogram_enabled = false;
+static PageHeapAllocator<SizeHistogram> histogram_allocator;
+static SizeHistogram* dead_thread_histogram = NULL;
+
+// Incremented to start a new recording.  Only the owner writes to a
+// thread's histogram, so each thread clears its own when it records the
+// next size; until then readers skip histograms of older generations.
+static volatile int size_histogram_generation = 0;
+
+static void ClearSizeHistogram(SizeHistogram* h) {
+  memset(h, 0, sizeof(*h));
+  h->generation = size_histogram_generation;
+}
+
+static void AddSizeHistogram(SizeHistogram* sum, const SizeHistogram* h) {
+  for (int b = 0; b < kHistogramBuckets; b++) {
+    sum->count[b] += h->count[b];
+    sum->bytes[b] += h->bytes[b];
+  }
+}
+
+// Sum of the histograms of all threads, living and dead, into "*sum".
+// The counts are read without synchronizing with the threads that
+// write them.  The lock is still needed because a thread that exits
+// merges its histogram into dead_thread_histogram and frees it, and
+// unlinks its cache from thread_heaps; without it we could read freed
+// memory or count an exiting thread twice.  Recording threads only
+// take the lock to allocate their first histogram.
+// REQUIRES: threadheap_lock is held
+static void MergeSizeHistograms(SizeHistogram* sum) {
+  ClearSizeHistogram(sum);
+  if (dead_thread_histogram != NULL) {
+    AddSizeHistogram(sum, dead_thread_histogram);
+  }
+  for (TCMalloc_ThreadCache* h = thread_heaps; h != NULL; h = h->next_) {
+    const SizeHistogram* histogram = h->histogram();
+    if (histogram != NULL && histogram->generation == sum->generation) {
+      AddSizeHistogram(sum, histogram);
+    }
+  }
+}
+
+// Forget all recorded sizes.  The histograms of living threads are
+// left to their owners (see size_histogram_generation).
+// REQUIRES: threadheap_lock is held
+static void ClearSizeHistograms() {
+  size_histogram_generation++;
+  if (dead_thread_histogram != NULL) {
+    ClearSizeHistogram(dead_thread_histogram);
+  }
+}
+
 // Global per-thread cache size.  Writes are protected by
-// pageheap_lock.  Reads are done without any locking, which should be
+// threadheap_lock.  Reads are done without any locking, which should be
 // fine as long as size_t can be written atomically and we don't place
 // invariants between this variable and other pieces of state.
 static volatile size_t per_thread_cache_size = kMaxThreadCacheSize;
 
+// Incremented to ask all threads to flush their caches (see
+// ReclaimForSoftLimit()).  Other threads' caches cannot be touched, so
+// each thread checks this on its way to the central cache or the page
+// heap and flushes if it changed.
+static volatile int cache_flush_generation = 0;
+
 //-------------------------------------------------------------------
 // Central cache implementation
 //-------------------------------------------------------------------
@@ -1061,11 +2289,15 @@ void TCMalloc_Central_FreeList::Init(size_t cl) {
   DLL_Init(&empty_);
   DLL_Init(&nonempty_);
   counter_ = 0;
+  released_bytes_ = 0;
+  span_scale_ = 1;
+  spans_fetched_ = 0;
+  spans_returned_ = 0;
 }
 
 void TCMalloc_Central_FreeList::Insert(void* object) {
   const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
-  Span* span = pageheap->GetDescriptor(p);
+  Span* span = GetDescriptor(p);
   ASSERT(span != NULL);
   ASSERT(span->refcount > 0);
 
@@ -1079,33 +2311,155 @@ void TCMalloc_Central_FreeList::Insert(void* object) {
   // The following check is expensive, so it is disabled by default
   if (false) {
     // Check that object does not occur in list
-    int got = 0;
+    size_t got = 0;
     for (void* p = span->objects; p != NULL; p = *((void**) p)) {
       ASSERT(p != object);
       got++;
     }
-    ASSERT(got + span->refcount == 
+    // "refcount" is a bit field, which promotes to int
+    ASSERT(got + static_cast<size_t>(span->refcount) == 
            (span->length<<kPageShift)/ByteSizeForClass(span->sizeclass));
   }
 
   counter_++;
   span->refcount--;
-  if (span->refcount == 0) {
+  // Objects on released pages are counted as in use until the whole
+  // span goes back to the page heap
+  const int released = span->released ? ReleasedObjects(span) : 0;
+  if (span->refcount == released) {
     Event(span, '#', 0);
     counter_ -= (span->length<<kPageShift) / ByteSizeForClass(span->sizeclass);
+    counter_ += released;
+    if (span->released) {
+      for (Length i = 0; i < span->length; i++) {
+        if (GetSizeClass(span->start + i) == kReleasedPageClass) {
+          released_bytes_ -= kPageSize;
+        }
+      }
+    }
     DLL_Remove(span);
+    spans_returned_++;
 
     // Release central list lock while operating on pageheap
     lock_.Unlock();
-    {
-      SpinLockHolder h(&pageheap_lock);
-      pageheap->Delete(span);
-    }
+    ReturnToPageHeap(span);
     lock_.Lock();
   } else {
     *(reinterpret_cast<void**>(object)) = span->objects;
     span->objects = object;
+    // Look for free pages each time the span has drained to a power of
+    // two, which bounds the work to a constant per object
+    const int refcount = span->refcount;
+    if (release_span_pages && span->length > 1 &&
+        (refcount & (refcount - 1)) == 0) {
+      ReleaseFreePages(span);
+    }
+  }
+}
+
+int TCMalloc_Central_FreeList::ReleasedObjects(const Span* span) const {
+  const size_t size = ByteSizeForClass(size_class_);
+  const size_t objects = (span->length << kPageShift) / size;
+  int result = 0;
+  for (Length i = 0; i < span->length; i++) {
+    if (GetSizeClass(span->start + i) != kReleasedPageClass) continue;
+    // Objects whose first byte is on page "i"
+    const size_t first = ((i << kPageShift) + size - 1) / size;
+    size_t end = (((i + 1) << kPageShift) + size - 1) / size;
+    if (end > objects) end = objects;
+    if (end > first) result += end - first;
+  }
+  return result;
+}
+
+void TCMalloc_Central_FreeList::ReleaseFreePages(Span* span) {
+  const size_t size = ByteSizeForClass(size_class_);
+  const Length n = span->length;
+  if (n > kMaxPages) return;
+  char* const base = reinterpret_cast<char*>(span->start << kPageShift);
+  const size_t objects = (n << kPageShift) / size;
+
+  // Count the free objects that overlap every page
+  unsigned short free_count[kMaxPages];
+  memset(free_count, 0, n * sizeof(free_count[0]));
+  for (void* p = span->objects; p != NULL; p = *(reinterpret_cast<void**>(p))) {
+    const size_t offset = reinterpret_cast<char*>(p) - base;
+    const Length last = (offset + size - 1) >> kPageShift;
+    for (Length i = offset >> kPageShift; i <= last; i++) free_count[i]++;
+  }
+
+  // A page can go if all objects that overlap it are free.  We cannot
+  // keep the objects that start on it in the free list, since their
+  // links would be lost.
+  bool release[kMaxPages];
+  bool any = false;
+  for (Length i = 0; i < n; i++) {
+    release[i] = false;
+    if (GetSizeClass(span->start + i) == kReleasedPageClass) continue;
+    const size_t first = (i << kPageShift) / size;
+    if (first >= objects) continue;   // Unused tail of the span
+    size_t last = (((i + 1) << kPageShift) - 1) / size;
+    if (last >= objects) last = objects - 1;
+    if (free_count[i] == last - first + 1) {
+      release[i] = true;
+      any = true;
+    }
+  }
+  if (!any) return;
+
+  // Drop the objects that start on those pages from the free list
+  int dropped = 0;
+  void** prev = &span->objects;
+  while (*prev != NULL) {
+    void* p = *prev;
+    const Length page = (reinterpret_cast<char*>(p) - base) >> kPageShift;
+    if (release[page]) {
+      *prev = *(reinterpret_cast<void**>(p));
+      dropped++;
+    } else {
+      prev = reinterpret_cast<void**>(p);
+    }
+  }
+  span->refcount += dropped;
+  counter_ -= dropped;
+  span->released = 1;
+  if (span->objects == NULL) {
+    // Move to empty list
+    DLL_Remove(span);
+    DLL_Prepend(&empty_, span);
+    Event(span, 'E', 0);
+  }
+
+  // Hand runs of pages back to the system
+  for (Length i = 0; i < n; ) {
+    if (!release[i]) { i++; continue; }
+    Length j = i;
+    while (j < n && release[j]) {
+      pagemap->set_sizeclass(span->start + j, kReleasedPageClass);
+      j++;
+    }
+    TCMalloc_SystemRelease(base + (i << kPageShift), (j - i) << kPageShift);
+    released_bytes_ += (j - i) << kPageShift;
+    i = j;
+  }
+}
+
+int TCMalloc_Central_FreeList::SpanOccupancy(
+    int occupancy[kOccupancyBuckets + 1]) {
+  for (int b = 0; b <= kOccupancyBuckets; b++) occupancy[b] = 0;
+  const size_t size = ByteSizeForClass(size_class_);
+  int spans = 0;
+  Span* lists[] = { &nonempty_, &empty_ };
+  for (int i = 0; i < 2; i++) {
+    for (Span* s = lists[i]->next; s != lists[i]; s = s->next) {
+      const size_t objects = (s->length << kPageShift) / size;
+      const size_t used = s->refcount;
+      occupancy[(used >= objects) ? kOccupancyBuckets
+                                  : used * kOccupancyBuckets / objects]++;
+      spans++;
+    }
   }
+  return spans;
 }
 
 void* TCMalloc_Central_FreeList::Remove() {
@@ -1126,17 +2480,46 @@ void* TCMalloc_Central_FreeList::Remove() {
   return result;
 }
 
+void TCMalloc_Central_FreeList::AdjustSpanScale() {
+  if (!adaptive_span_pages) {
+    span_scale_ = 1;
+    spans_fetched_ = spans_returned_ = 0;
+    return;
+  }
+  if (++spans_fetched_ < kSpanScaleInterval) return;
+  const size_t pages = class_to_pages[size_class_];
+  if (spans_returned_ == 0) {
+    // All recent spans are still in use: fetch more at a time, as long
+    // as Span::refcount can still count the objects of a span (the same
+    // limit size_class_gen applies to class_to_pages[])
+    const size_t bytes = (2 * span_scale_ * pages) << kPageShift;
+    if (span_scale_ < kMaxSpanScale && bytes <= kMaxAdaptedSpanBytes &&
+        bytes / ByteSizeForClass(size_class_) < (1 << 15)) {
+      span_scale_ *= 2;
+    }
+  } else if (2 * spans_returned_ >= spans_fetched_) {
+    // Spans come back about as often as they are fetched: big ones
+    // would mostly hold idle objects
+    if (span_scale_ > 1) span_scale_ /= 2;
+  }
+  spans_fetched_ = 0;
+  spans_returned_ = 0;
+}
+
 // Fetch memory from the system and add to the central cache freelist.
 void TCMalloc_Central_FreeList::Populate() {
+  AdjustSpanScale();
+  const Length npages = span_pages();
+
   // Release central list lock while operating on pageheap
   lock_.Unlock();
-  const size_t npages = class_to_pages[size_class_];
 
   Span* span;
   {
-    SpinLockHolder h(&pageheap_lock);
-    span = pageheap->New(npages);
-    if (span) pageheap->RegisterSizeClass(span, size_class_);
+    TCMalloc_PageHeap* heap = LocalPageHeap();
+    SpinLockHolder h(&heap->lock_);
+    span = heap->New(npages);
+    if (span) heap->RegisterSizeClass(span, size_class_);
   }
   if (span == NULL) {
     MESSAGE("allocation failed: %d\n", errno);
@@ -1190,6 +2573,14 @@ void TCMalloc_ThreadCache::Init(pthread_t tid) {
   for (size_t cl = 0; cl < kNumClasses; ++cl) {
     list_[cl].Init();
   }
+  large_size_ = 0;
+  for (Length n = 0; n <= kMaxCachedLargePages; ++n) {
+    large_[n].Init();
+  }
+  large_hits_ = 0;
+  large_evictions_ = 0;
+  histogram_ = NULL;
+  flush_generation_ = cache_flush_generation;
 
   // Initialize RNG -- run it for a bit to get to good values
   rnd_ = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(this));
@@ -1208,6 +2599,15 @@ void TCMalloc_ThreadCache::Cleanup() {
       dst->Insert(src->Pop());
     }
   }
+  ReleaseLargeSpans(0);
+}
+
+void TCMalloc_ThreadCache::Flush() {
+  flush_generation_ = cache_flush_generation;
+  for (int cl = 0; cl < kNumClasses; ++cl) {
+    if (!list_[cl].empty()) ReleaseToCentralCache(cl, list_[cl].length());
+  }
+  ReleaseLargeSpans(0);
 }
 
 inline void* TCMalloc_ThreadCache::Allocate(size_t size) {
@@ -1228,17 +2628,83 @@ inline void TCMalloc_ThreadCache::Deallocate(void* ptr, size_t cl) {
   list->Push(ptr);
   // If enough data is free, put back into central cache
   if (list->length() > kMaxFreeListLength) {
-    ReleaseToCentralCache(cl, kNumObjectsToMove);
+    ReleaseToCentralCache(cl, class_to_move[cl]);
+  }
+  if (size_ + large_size_ >= per_thread_cache_size) Scavenge();
+}
+
+inline void* TCMalloc_ThreadCache::AllocateLarge(Length n) {
+  if (n > kMaxCachedLargePages) return NULL;
+  FreeList* list = &large_[n];
+  if (list->empty()) return NULL;
+  large_size_ -= n << kPageShift;
+  large_hits_++;
+  return list->Pop();
+}
+
+inline void TCMalloc_ThreadCache::RecordSize(size_t size) {
+  if (histogram_ == NULL ||
+      histogram_->generation != size_histogram_generation) {
+    ResetHistogram();
+  }
+  const int b = HistogramBucket(size);
+  histogram_->count[b]++;
+  histogram_->bytes[b] += size;
+}
+
+void TCMalloc_ThreadCache::ResetHistogram() {
+  SizeHistogram* h = histogram_;
+  if (h == NULL) {
+    SpinLockHolder l(&threadheap_lock);
+    h = histogram_allocator.New();
+  }
+  ClearSizeHistogram(h);
+  histogram_ = h;
+}
+
+inline bool TCMalloc_ThreadCache::DeallocateLarge(Span* span) {
+  const Length n = span->length;
+  if (n > kMaxCachedLargePages) return false;
+  if (flush_generation_ != cache_flush_generation) {
+    Flush();
+    return false;
+  }
+  large_[n].Push(reinterpret_cast<void*>(span->start << kPageShift));
+  large_size_ += n << kPageShift;
+  if (size_ + large_size_ > per_thread_cache_size) {
+    // Small objects and spans share the limit.  Drop to half of it so
+    // that we do not come back here on every following free.
+    const size_t half = per_thread_cache_size / 2;
+    ReleaseLargeSpans((size_ < half) ? half - size_ : 0);
+  }
+  return true;
+}
+
+void TCMalloc_ThreadCache::ReleaseLargeSpans(size_t target) {
+  if (large_size_ <= target) return;
+  // Evict the longest spans first: they pin the most memory and are
+  // the cheapest to re-allocate relative to their size.
+  for (Length n = kMaxCachedLargePages; n > 0 && large_size_ > target; n--) {
+    FreeList* list = &large_[n];
+    while (!list->empty() && large_size_ > target) {
+      const PageID p = reinterpret_cast<uintptr_t>(list->Pop()) >> kPageShift;
+      Span* span = GetDescriptor(p);
+      ASSERT(span->start == p && span->length == n);
+      large_size_ -= n << kPageShift;
+      large_evictions_++;
+      ReturnToPageHeap(span);
+    }
   }
-  if (size_ >= per_thread_cache_size) Scavenge();
 }
 
 // Remove some objects of class "cl" from central cache and add to thread heap
 void TCMalloc_ThreadCache::FetchFromCentralCache(size_t cl) {
+  if (flush_generation_ != cache_flush_generation) Flush();
   TCMalloc_Central_FreeList* src = &central_cache[cl];
   FreeList* dst = &list_[cl];
   SpinLockHolder h(&src->lock_);
-  for (int i = 0; i < kNumObjectsToMove; i++) {
+  const int N = class_to_move[cl];
+  for (int i = 0; i < N; i++) {
     void* object = src->Remove();
     if (object == NULL) {
       if (i == 0) {
@@ -1277,6 +2743,11 @@ void TCMalloc_ThreadCache::Scavenge() {
   // pretty soon and the low-water marks will be high on that call.
   //int64 start = CycleClock::Now();
 
+  if (flush_generation_ != cache_flush_generation) {
+    Flush();
+    return;
+  }
+
   for (int cl = 0; cl < kNumClasses; cl++) {
     FreeList* list = &list_[cl];
     const int lowmark = list->lowwatermark();
@@ -1287,6 +2758,20 @@ void TCMalloc_ThreadCache::Scavenge() {
     list->clear_lowwatermark();
   }
 
+  // Same policy for cached page-level spans
+  for (Length n = 1; n <= kMaxCachedLargePages; n++) {
+    FreeList* list = &large_[n];
+    const int lowmark = list->lowwatermark();
+    for (int i = (lowmark > 1) ? lowmark/2 : lowmark; i > 0; i--) {
+      const PageID p = reinterpret_cast<uintptr_t>(list->Pop()) >> kPageShift;
+      Span* span = GetDescriptor(p);
+      large_size_ -= n << kPageShift;
+      large_evictions_++;
+      ReturnToPageHeap(span);
+    }
+    list->clear_lowwatermark();
+  }
+
   //int64 finish = CycleClock::Now();
   //CycleTimer ct;
   //MESSAGE("GC: %.0f ns\n", ct.CyclesToUsec(finish-start)*1000.0);
@@ -1311,6 +2796,38 @@ inline TCMalloc_ThreadCache* TCMalloc_ThreadCache::GetCacheIfPresent() {
   return reinterpret_cast<TCMalloc_ThreadCache*>(pthread_getspecific(heap_key));
 }
 
+// Give the free memory of the page heap partitions back to the system
+// until at least "n" pages went back.  Returns the number of pages.
+// REQUIRES: no lock is held
+static Length ReleasePageHeaps(Length n) {
+  Length released = 0;
+  for (int i = 0; i < kMaxPageHeaps && released < n; i++) {
+    TCMalloc_PageHeap* heap = pageheaps[i];
+    if (heap == NULL) continue;
+    SpinLockHolder h(&heap->lock_);
+    released += heap->ReleaseFreeSpans(n - released);
+  }
+  return released;
+}
+
+static void ReclaimForSoftLimit(uint64_t bytes) {
+  { // scope
+    SpinLockHolder h(&heap_limit_lock);
+    soft_limit_hits++;
+  }
+  const Length n = (bytes + kPageSize - 1) >> kPageShift;
+  const Length released = ReleasePageHeaps(n);
+  if (released >= n) return;
+
+  // Our own cache goes back now, the others on their next slow path.
+  // Spans whose objects are then all free leave the central cache for
+  // the page heap right away.
+  cache_flush_generation++;
+  TCMalloc_ThreadCache* cache = TCMalloc_ThreadCache::GetCacheIfPresent();
+  if (cache != NULL) cache->Flush();
+  ReleasePageHeaps(n - released);
+}
+
 void TCMalloc_ThreadCache::PickNextSample() {
   // Make next "random" number
   // x^32+x^22+x^2+x^1+1 is a primitive polynomial for random numbers
@@ -1323,6 +2840,24 @@ void TCMalloc_ThreadCache::PickNextSample() {
   bytes_until_sample_ = rnd_ % kSampleParameter;
 }
 
+// NUMA node that partition "index" binds its memory to.  Memory is
+// only bound to nodes on real NUMA machines.
+static int PageHeapNode(int index) {
+  const int nodes = TCMalloc_NumaNodeCount();
+  const int slot = index % kMaxNumaNodes;
+  return (slot < nodes && nodes > 1) ? slot : -1;
+}
+
+// Construct partition "index" the first time a thread is routed to it
+static TCMalloc_PageHeap* CreatePageHeap(int index) {
+  SpinLockHolder h(&pageheap_lock);
+  if (pageheaps[index] == NULL) {
+    pageheaps[index] = new ((void*)pageheap_memory[index])
+                       TCMalloc_PageHeap(pagemap, index, PageHeapNode(index));
+  }
+  return pageheaps[index];
+}
+
 void TCMalloc_ThreadCache::InitModule() {
   // There is a slight potential race here because of double-checked
   // locking idiom.  However, as long as the program does a small
@@ -1331,16 +2866,64 @@ void TCMalloc_ThreadCache::InitModule() {
   // by doing one in the constructor of the module_enter_exit_hook
   // object declared below.
   SpinLockHolder h(&pageheap_lock);
-  if (pageheap == NULL) {
+  if (pagemap == NULL) {
+    // Before any memory is allocated
+    const char* env = getenv("TCMALLOC_HEAP_HUGE_PAGES");
+    if (env != NULL) heap_huge_pages = HugePagesAdvice(atoi(env));
+    env = getenv("TCMALLOC_METADATA_HUGE_PAGES");
+    if (env != NULL) metadata_huge_pages = HugePagesAdvice(atoi(env));
+
     InitSizeClasses();
     threadheap_allocator.Init();
-    span_allocator.Init();
     stacktrace_allocator.Init();
     DLL_Init(&sampled_objects);
     for (int i = 0; i < kNumClasses; ++i) {
       central_cache[i].Init(i);
     }
-    pageheap = new ((void*)pageheap_memory) TCMalloc_PageHeap;
+    PageMap* map = new ((void*)pagemap_memory) PageMap(MetaDataAlloc);
+    pageheaps[0] = new ((void*)pageheap_memory[0])
+                   TCMalloc_PageHeap(map, 0, PageHeapNode(0));
+    // Partitioning is opt-in
+    env = getenv("TCMALLOC_NUMA_AWARE");
+    if (env != NULL && atoi(env) != 0) {
+      const int nodes = TCMalloc_NumaNodeCount();
+      num_pageheaps = (nodes < kMaxNumaNodes) ? nodes : kMaxNumaNodes;
+    }
+    env = getenv("TCMALLOC_PAGEHEAP_SHARDS");
+    if (env != NULL && atoi(env) > 1) {
+      const int shards = atoi(env);
+      num_pageheap_shards = (shards < kMaxPageHeapShards) ? shards
+                                                          : kMaxPageHeapShards;
+    }
+    env = getenv("TCMALLOC_ADDRESS_ORDERED");
+    if (env != NULL && atoi(env) != 0) {
+      address_ordered_allocation = true;
+    }
+    env = getenv("TCMALLOC_DEFERRED_COALESCING");
+    if (env != NULL && atoi(env) != 0) {
+      deferred_coalescing = true;
+    }
+    env = getenv("TCMALLOC_RELEASE_SPAN_PAGES");
+    if (env != NULL && atoi(env) != 0) {
+      release_span_pages = true;
+    }
+    env = getenv("TCMALLOC_ADAPTIVE_SPAN_PAGES");
+    if (env != NULL && atoi(env) != 0) {
+      adaptive_span_pages = true;
+    }
+    env = getenv("TCMALLOC_PAGEHEAP_TRACE");
+    if (env != NULL && atoi(env) != 0) {
+      SetPageHeapTrace(true);
+    }
+    env = getenv("TCMALLOC_SIZE_HISTOGRAM");
+    if (env != NULL && atoi(env) != 0) {
+      size_histogram_enabled = true;
+    }
+    env = getenv("TCMALLOC_HEAP_SOFT_LIMIT_MB");
+    if (env != NULL) heap_soft_limit = static_cast<size_t>(atoi(env)) << 20;
+    env = getenv("TCMALLOC_HEAP_HARD_LIMIT_MB");
+    if (env != NULL) heap_hard_limit = static_cast<size_t>(atoi(env)) << 20;
+    pagemap = map;
   }
 }
 
@@ -1354,7 +2937,7 @@ void TCMalloc_ThreadCache::InitTSD() {
   // We may have used a fake pthread_t for the main thread.  Fix it.
   pthread_t zero;
   memset(&zero, 0, sizeof(zero));
-  SpinLockHolder h(&pageheap_lock);
+  SpinLockHolder h(&threadheap_lock);
   for (TCMalloc_ThreadCache* h = thread_heaps; h != NULL; h = h->next_) {
     if (h->tid_ == zero) {
       h->tid_ = pthread_self();
@@ -1366,7 +2949,7 @@ void* TCMalloc_ThreadCache::CreateCacheIfNecessary() {
   // Initialize per-thread data if necessary
   TCMalloc_ThreadCache* heap = NULL;
   {
-    SpinLockHolder h(&pageheap_lock);
+    SpinLockHolder h(&threadheap_lock);
 
     // Early on in glibc's life, we cannot even call pthread_self()
     pthread_t me;
@@ -1417,7 +3000,21 @@ void TCMalloc_ThreadCache::DeleteCache(void* ptr) {
   heap->Cleanup();
 
   // Remove from linked list
-  SpinLockHolder h(&pageheap_lock);
+  SpinLockHolder h(&threadheap_lock);
+  dead_thread_span_hits += heap->large_hits();
+  dead_thread_span_evicts += heap->large_evictions();
+  SizeHistogram* histogram = heap->TakeHistogram();
+  if (histogram != NULL) {
+    if (histogram->generation != size_histogram_generation) {
+      ClearSizeHistogram(histogram);
+    }
+    if (dead_thread_histogram == NULL) {
+      dead_thread_histogram = histogram;
+    } else {
+      AddSizeHistogram(dead_thread_histogram, histogram);
+      histogram_allocator.Delete(histogram);
+    }
+  }
   if (heap->next_ != NULL) heap->next_->prev_ = heap->prev_;
   if (heap->prev_ != NULL) heap->prev_->next_ = heap->next_;
   if (thread_heaps == heap) thread_heaps = heap->next_;
@@ -1452,27 +3049,52 @@ void TCMalloc_ThreadCache::Print() const {
 struct TCMallocStats {
   uint64_t system_bytes;        // Bytes alloced from system
   uint64_t thread_bytes;        // Bytes in thread caches
+  uint64_t thread_span_bytes;   // Bytes in thread caches of large spans
+  uint64_t thread_span_hits;    // Large allocs served from thread caches
+  uint64_t thread_span_evicts;  // Cached large spans returned to page heap
   uint64_t central_bytes;       // Bytes in central cache
+  uint64_t central_released_bytes; // Bytes released inside central spans
   uint64_t pageheap_bytes;      // Bytes in page heap
+  uint64_t pageheap_top_bytes;  // Bytes free at top of page heap
+  uint64_t deferred_bytes;      // Bytes free in spans not coalesced yet
   uint64_t metadata_bytes;      // Bytes alloced for metadata
+  uint64_t pagemap_bytes;       // Bytes of metadata in the pagemap
+  uint64_t huge_page_bytes;     // Bytes advised to use huge pages
+  uint64_t no_huge_page_bytes;  // Bytes advised not to use them
+  uint64_t soft_limit_hits;     // Reclaims before growing past soft limit
+  uint64_t hard_limit_hits;     // Growths refused by the hard limit
+  uint64_t released_bytes;      // Bytes of free spans given back
+  uint64_t spans;               // Span descriptors in use
+  uint64_t thread_heaps;        // Thread heaps in use
+  uint64_t node_system_bytes[kMaxNumaNodes];    // Per node, all shards
+  uint64_t node_pageheap_bytes[kMaxNumaNodes];  // Per node, all shards
 };
 
 // Get stats into "r".  Also get per-size-class counts if class_count != NULL
 static void ExtractStats(TCMallocStats* r, uint64_t* class_count) {
   r->central_bytes = 0;
+  r->central_released_bytes = 0;
   for (int cl = 0; cl < kNumClasses; ++cl) {
     SpinLockHolder h(&central_cache[cl].lock_);
     const int length = central_cache[cl].length();
     r->central_bytes += static_cast<uint64_t>(ByteSizeForClass(cl)) * length;
+    r->central_released_bytes += central_cache[cl].released_bytes();
     if (class_count) class_count[cl] = length;
   }
 
   // Add stats from per-thread heaps
   r->thread_bytes = 0;
+  r->thread_span_bytes = 0;
   { // scope
-    SpinLockHolder h(&pageheap_lock);
+    SpinLockHolder h(&threadheap_lock);
+    r->thread_heaps = threadheap_allocator.inuse();
+    r->thread_span_hits = dead_thread_span_hits;
+    r->thread_span_evicts = dead_thread_span_evicts;
     for (TCMalloc_ThreadCache* h = thread_heaps; h != NULL; h = h->next_) {
       r->thread_bytes += h->Size();
+      r->thread_span_bytes += h->LargeSize();
+      r->thread_span_hits += h->large_hits();
+      r->thread_span_evicts += h->large_evictions();
       if (class_count) {
         for (int cl = 0; cl < kNumClasses; ++cl) {
           class_count[cl] += h->freelist_length(cl);
@@ -1481,14 +3103,173 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count) {
     }
   }
 
+  // Add stats from page heap partitions, one at a time
+  r->system_bytes = 0;
+  r->pageheap_bytes = 0;
+  r->pageheap_top_bytes = 0;
+  r->deferred_bytes = 0;
+  r->spans = 0;
+  for (int n = 0; n < kMaxNumaNodes; n++) {
+    r->node_system_bytes[n] = 0;
+    r->node_pageheap_bytes[n] = 0;
+  }
+  for (int i = 0; i < kMaxPageHeaps; i++) {
+    TCMalloc_PageHeap* heap = pageheaps[i];
+    if (heap == NULL) continue;
+    SpinLockHolder h(&heap->lock_);
+    const uint64_t system_bytes = heap->SystemBytes();
+    const uint64_t free_bytes = heap->FreeBytes();
+    r->node_system_bytes[i % kMaxNumaNodes] += system_bytes;
+    r->node_pageheap_bytes[i % kMaxNumaNodes] += free_bytes;
+    r->system_bytes += system_bytes;
+    r->pageheap_bytes += free_bytes;
+    r->pageheap_top_bytes += heap->TopFreeBytes();
+    r->deferred_bytes += heap->DeferredBytes();
+    r->spans += heap->SpansInUse();
+  }
+
   { //scope
-    SpinLockHolder h(&pageheap_lock);
-    r->system_bytes = pageheap->SystemBytes();
+    SpinLockHolder h(&metadata_lock);
     r->metadata_bytes = metadata_system_bytes;
-    r->pageheap_bytes = pageheap->FreeBytes();
+    r->huge_page_bytes = huge_pages_advised_bytes[kHugePagesAlways];
+    r->no_huge_page_bytes = huge_pages_advised_bytes[kHugePagesNever];
+  }
+  { //scope
+    SpinLockHolder h(&heap_limit_lock);
+    r->soft_limit_hits = soft_limit_hits;
+    r->hard_limit_hits = hard_limit_hits;
+    r->released_bytes = heap_released_bytes;
+  }
+  { //scope
+    SpinLockHolder h(&pagemap_lock);
+    r->pagemap_bytes = (pagemap != NULL) ? pagemap->bytes() : 0;
   }
 }
                      
+// Size of a span descriptor before its fields were packed: five
+// pointer-sized fields and the flags, rounded up to pointer alignment
+static const size_t kUnpackedSpanSize = 6 * sizeof(void*);
+
+// Merged size histograms for the readers below.  Protected by
+// threadheap_lock.
+static SizeHistogram histogram_snapshot;
+
+// Write the size histogram to "out" in the "size count" format that
+// size_class_gen reads, followed by the rounding waste of each bucket.
+static void DumpSizeHistogram(TCMalloc_Printer* out) {
+  SpinLockHolder h(&threadheap_lock);
+  MergeSizeHistograms(&histogram_snapshot);
+  const SizeHistogram& hist = histogram_snapshot;
+  out->printf("# Requested allocation sizes; \"size\" is the largest size in\n"
+              "# the bucket, \"waste\" the bytes lost to rounding up to \"class\"\n"
+              "#      size        count            bytes        waste class\n");
+  const int small_buckets = kHistogramSmallBuckets + kHistogramMediumBuckets;
+  for (int b = 0; b < small_buckets; b++) {
+    if (hist.count[b] == 0) continue;
+    const size_t size = HistogramBucketSize(b);
+    const int cl = SizeClass(size);
+    const uint64_t waste = hist.count[b] * ByteSizeForClass(cl) - hist.bytes[b];
+    out->printf("%11" PRIuS " %12" LLU " %16" LLU " %12" LLU " %5d\n",
+                size, hist.count[b], hist.bytes[b], waste, cl);
+  }
+  out->printf("# Page-level allocations, by power of two\n");
+  for (int b = small_buckets; b < kHistogramBuckets; b++) {
+    if (hist.count[b] == 0) continue;
+    out->printf("%11" PRIuS " %12" LLU " %16" LLU "\n",
+                HistogramBucketSize(b), hist.count[b], hist.bytes[b]);
+  }
+}
+
+// WRITE the level 3 fragmentation report to "out"
+static void DumpFragmentation(TCMalloc_Printer* out) {
+  // The memory lost to rounding up to a size class is exact if the
+  // size histogram has recorded anything, and otherwise estimated from
+  // the sampled objects, the only others whose requested size is known.
+  uint64_t class_requested[kNumClasses];
+  uint64_t class_rounded[kNumClasses];
+  for (int cl = 0; cl < kNumClasses; cl++) {
+    class_requested[cl] = 0;
+    class_rounded[cl] = 0;
+  }
+  bool from_histogram = false;
+  { // scope
+    SpinLockHolder h(&threadheap_lock);
+    MergeSizeHistograms(&histogram_snapshot);
+    const int small_buckets = kHistogramSmallBuckets + kHistogramMediumBuckets;
+    for (int b = 0; b < small_buckets; b++) {
+      const uint64_t count = histogram_snapshot.count[b];
+      if (count == 0) continue;
+      const int cl = SizeClass(HistogramBucketSize(b));
+      class_requested[cl] += histogram_snapshot.bytes[b];
+      class_rounded[cl] += count * ByteSizeForClass(cl);
+      from_histogram = true;
+    }
+  }
+  if (!from_histogram) {
+    SpinLockHolder h(&sample_lock);
+    for (Span* s = sampled_objects.next; s != &sampled_objects; s = s->next) {
+      const size_t size = reinterpret_cast<StackTrace*>(s->objects)->size;
+      if (size > kMaxSize) continue;
+      const int cl = SizeClass(size);
+      class_requested[cl] += size;
+      class_rounded[cl] += ByteSizeForClass(cl);
+    }
+  }
+
+  out->printf("------------------------------------------------\n"
+              "Size class fragmentation (spans by objects in use;"
+              " waste from %s)\n"
+              "class     size  spans objs/span"
+              "   <25%%   <50%%   <75%%  <100%%   full"
+              "  waste        bytes\n",
+              from_histogram ? "size histogram" : "sampled objects");
+  uint64_t total_requested = 0;
+  uint64_t total_rounded = 0;
+  for (int cl = 1; cl < kNumClasses; cl++) {
+    if (ByteSizeForClass(cl) == 0) break;     // Past the last class
+    int occupancy[kOccupancyBuckets + 1];
+    int spans;
+    Length span_pages;
+    { // scope
+      SpinLockHolder h(&central_cache[cl].lock_);
+      spans = central_cache[cl].SpanOccupancy(occupancy);
+      span_pages = central_cache[cl].span_pages();
+    }
+    if (spans == 0 && class_rounded[cl] == 0) continue;
+    const size_t size = ByteSizeForClass(cl);
+    out->printf("%5d %8" PRIuS " %6d %9" PRIuS,
+                cl, size, spans, (span_pages << kPageShift) / size);
+    for (int b = 0; b <= kOccupancyBuckets; b++) {
+      out->printf(" %6d", occupancy[b]);
+    }
+    if (class_rounded[cl] > 0) {
+      const uint64_t waste = class_rounded[cl] - class_requested[cl];
+      out->printf(" %5.1f%% %12" LLU "\n",
+                  100.0 * waste / class_rounded[cl], waste);
+    } else {
+      out->printf("      -            -\n");
+    }
+    total_requested += class_requested[cl];
+    total_rounded += class_rounded[cl];
+  }
+  if (total_rounded > 0) {
+    const uint64_t waste = total_rounded - total_requested;
+    out->printf("%s internal fragmentation: %.1f%% (%" LLU " bytes)\n",
+                from_histogram ? "Recorded" : "Sampled",
+                100.0 * waste / total_rounded, waste);
+  }
+
+  for (int i = 0; i < kMaxPageHeaps; i++) {
+    TCMalloc_PageHeap* heap = pageheaps[i];
+    if (heap == NULL) continue;
+    SpinLockHolder h(&heap->lock_);
+    out->printf("------------------------------------------------\n"
+                "Page heap partition %d fragmentation:\n", i);
+    heap->DumpFragmentation(out);
+  }
+  out->printf("------------------------------------------------\n");
+}
+
 // WRITE stats to "out"
 static void DumpStats(TCMalloc_Printer* out, int level) {
   TCMallocStats stats;
@@ -1511,37 +3292,90 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       }
     }
 
-    SpinLockHolder h(&pageheap_lock);
-    pageheap->Dump(out);
+    for (int i = 0; i < kMaxPageHeaps; i++) {
+      TCMalloc_PageHeap* heap = pageheaps[i];
+      if (heap == NULL) continue;
+      SpinLockHolder h(&heap->lock_);
+      if (i > 0) {
+        out->printf("Page heap partition %d (node %d, shard %d):\n",
+                    i, i % kMaxNumaNodes, i / kMaxNumaNodes);
+      }
+      heap->Dump(out);
+    }
   }
   
   const uint64_t bytes_in_use = stats.system_bytes
                                 - stats.pageheap_bytes
                                 - stats.central_bytes
-                                - stats.thread_bytes;
+                                - stats.central_released_bytes
+                                - stats.thread_bytes
+                                - stats.thread_span_bytes;
 
   out->printf("------------------------------------------------\n"
               "MALLOC: %12" LLU " Heap size\n"
               "MALLOC: %12" LLU " Bytes in use by application\n"
               "MALLOC: %12" LLU " Bytes free in page heap\n"
+              "MALLOC: %12" LLU " Bytes free at top of page heap\n"
+              "MALLOC: %12" LLU " Bytes free in page heap given back\n"
               "MALLOC: %12" LLU " Bytes free in central cache\n"
+              "MALLOC: %12" LLU " Bytes released inside central cache spans\n"
               "MALLOC: %12" LLU " Bytes free in thread caches\n"
+              "MALLOC: %12" LLU " Bytes free in thread span caches\n"
               "MALLOC: %12" LLU " Spans in use\n"
               "MALLOC: %12" LLU " Thread heaps in use\n"
-              "MALLOC: %12" LLU " Metadata allocated\n"
+              "MALLOC: %12" LLU " Metadata allocated"
+              " (%" LLU " saved by packed spans)\n"
+              "MALLOC: %12" LLU " Bytes in page map\n"
+              "MALLOC: %12" LLU " Bytes advised to use huge pages\n"
+              "MALLOC: %12" LLU " Bytes advised not to use huge pages\n"
+              "MALLOC: %12" LLU " Large allocs from thread span caches\n"
+              "MALLOC: %12" LLU " Spans evicted from thread span caches\n"
+              "MALLOC: %12" LLU " Heap soft limit (0 = none)\n"
+              "MALLOC: %12" LLU " Heap hard limit (0 = none)\n"
+              "MALLOC: %12" LLU " Reclaims at the soft limit\n"
+              "MALLOC: %12" LLU " Heap growths refused by the hard limit\n"
               "------------------------------------------------\n",
               stats.system_bytes,
               bytes_in_use,
               stats.pageheap_bytes,
+              stats.pageheap_top_bytes,
+              stats.released_bytes,
               stats.central_bytes,
+              stats.central_released_bytes,
               stats.thread_bytes,
-              uint64_t(span_allocator.inuse()),
-              uint64_t(threadheap_allocator.inuse()),
-              stats.metadata_bytes);
+              stats.thread_span_bytes,
+              stats.spans,
+              stats.thread_heaps,
+              stats.metadata_bytes,
+              stats.spans * (kUnpackedSpanSize - sizeof(Span)),
+              stats.pagemap_bytes,
+              stats.huge_page_bytes,
+              stats.no_huge_page_bytes,
+              stats.thread_span_hits,
+              stats.thread_span_evicts,
+              static_cast<uint64_t>(heap_soft_limit),
+              static_cast<uint64_t>(heap_hard_limit),
+              stats.soft_limit_hits,
+              stats.hard_limit_hits);
+
+  // Per-node breakdown, only when partitions have been used
+  for (int i = 1; i < kMaxNumaNodes; i++) {
+    if (stats.node_system_bytes[i] == 0) continue;
+    for (int n = 0; n < kMaxNumaNodes; n++) {
+      if (stats.node_system_bytes[n] == 0) continue;
+      out->printf("MALLOC: node %d: %12" LLU " Heap size; "
+                  "%12" LLU " Bytes free in page heap\n",
+                  n, stats.node_system_bytes[n], stats.node_pageheap_bytes[n]);
+    }
+    out->printf("------------------------------------------------\n");
+    break;
+  }
+
+  if (level >= 3) DumpFragmentation(out);
 }
 
 static void PrintStats(int level) {
-  const int kBufferSize = 16 << 10;
+  const int kBufferSize = (level >= 3 ? 64 : 16) << 10;
   char* buffer = new char[kBufferSize];
   TCMalloc_Printer printer(buffer, kBufferSize);
   DumpStats(&printer, level);
@@ -1553,7 +3387,7 @@ static void** DumpStackTraces() {
   // Count how much space we need
   int needed_slots = 0;
   {
-    SpinLockHolder h(&pageheap_lock);
+    SpinLockHolder h(&sample_lock);
     for (Span* s = sampled_objects.next; s != &sampled_objects; s = s->next) {
       StackTrace* stack = reinterpret_cast<StackTrace*>(s->objects);
       needed_slots += 3 + stack->depth;
@@ -1569,7 +3403,7 @@ static void** DumpStackTraces() {
     return NULL;
   }
   
-  SpinLockHolder h(&pageheap_lock);
+  SpinLockHolder h(&sample_lock);
   int used_slots = 0;
   for (Span* s = sampled_objects.next; s != &sampled_objects; s = s->next) {
     ASSERT(used_slots < needed_slots);  // Need to leave room for terminator
@@ -1600,6 +3434,18 @@ class TCMallocImplementation : public MallocInterface {
     DumpStats(&printer, 2);
   }
 
+  virtual void GetFragmentationReport(char* buffer, int buffer_length) {
+    ASSERT(buffer_length > 0);
+    TCMalloc_Printer printer(buffer, buffer_length);
+    DumpFragmentation(&printer);
+  }
+
+  virtual void GetSizeHistogram(char* buffer, int buffer_length) {
+    ASSERT(buffer_length > 0);
+    TCMalloc_Printer printer(buffer, buffer_length);
+    DumpSizeHistogram(&printer);
+  }
+
   virtual void** ReadStackTraces() {
     return DumpStackTraces();
   }
@@ -1612,7 +3458,9 @@ class TCMallocImplementation : public MallocInterface {
       ExtractStats(&stats, NULL);
       *value = stats.system_bytes
                - stats.thread_bytes
+               - stats.thread_span_bytes
                - stats.central_bytes
+               - stats.central_released_bytes
                - stats.pageheap_bytes;
       return true;
     }
@@ -1634,7 +3482,7 @@ class TCMallocImplementation : public MallocInterface {
     }
 
     if (strcmp(name, "tcmalloc.max_total_thread_cache_bytes") == 0) {
-      SpinLockHolder l(&pageheap_lock);
+      SpinLockHolder l(&threadheap_lock);
       *value = overall_thread_cache_size;
       return true;
     }
@@ -1646,6 +3494,146 @@ class TCMallocImplementation : public MallocInterface {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.current_total_thread_span_cache_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.thread_span_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.numa_partitions") == 0) {
+      *value = num_pageheaps;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_shards") == 0) {
+      *value = num_pageheap_shards;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.address_ordered_allocation") == 0) {
+      *value = address_ordered_allocation;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.deferred_coalescing") == 0) {
+      *value = deferred_coalescing;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_span_pages") == 0) {
+      *value = release_span_pages;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.adaptive_span_pages") == 0) {
+      *value = adaptive_span_pages;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.span_released_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.central_released_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pagemap_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.pagemap_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_top_free_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.pageheap_top_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_trace") == 0) {
+      *value = pageheap_trace_enabled;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.size_classes") == 0) {
+      *value = num_size_classes - 1;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.size_histogram") == 0) {
+      *value = size_histogram_enabled;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.page_size") == 0) {
+      *value = kPageSize;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.heap_huge_pages") == 0) {
+      *value = heap_huge_pages;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.metadata_huge_pages") == 0) {
+      *value = metadata_huge_pages;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.huge_page_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.huge_page_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.no_huge_page_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.no_huge_page_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.heap_soft_limit") == 0) {
+      *value = heap_soft_limit;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.heap_hard_limit") == 0) {
+      *value = heap_hard_limit;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.soft_limit_hits") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.soft_limit_hits;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.hard_limit_hits") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.hard_limit_hits;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_deferred_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.deferred_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_released_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL);
+      *value = stats.released_bytes;
+      return true;
+    }
+
     return false;
   }
 
@@ -1657,14 +3645,162 @@ class TCMallocImplementation : public MallocInterface {
       if (value < kMinThreadCacheSize) value = kMinThreadCacheSize;
       if (value > (1<<30)) value = (1<<30);     // Limit to 1GB
 
-      SpinLockHolder l(&pageheap_lock);
+      SpinLockHolder l(&threadheap_lock);
       overall_thread_cache_size = static_cast<size_t>(value);
       TCMalloc_ThreadCache::RecomputeThreadCacheSize();
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.numa_partitions") == 0) {
+      // Values above the number of nodes are allowed so that the
+      // partitioning can be exercised on a single-node machine.
+      if (value < 1) value = 1;
+      if (value > kMaxNumaNodes) value = kMaxNumaNodes;
+      SpinLockHolder l(&pageheap_lock);
+      num_pageheaps = static_cast<int>(value);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_shards") == 0) {
+      if (value < 1) value = 1;
+      if (value > kMaxPageHeapShards) value = kMaxPageHeapShards;
+      SpinLockHolder l(&pageheap_lock);
+      num_pageheap_shards = static_cast<int>(value);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.address_ordered_allocation") == 0) {
+      const bool was_set = address_ordered_allocation;
+      address_ordered_allocation = (value != 0);
+      if (address_ordered_allocation && !was_set) {
+        // The lists were filled in the order spans were freed
+        for (int i = 0; i < kMaxPageHeaps; i++) {
+          TCMalloc_PageHeap* heap = pageheaps[i];
+          if (heap == NULL) continue;
+          SpinLockHolder h(&heap->lock_);
+          heap->SortFreeLists();
+        }
+      }
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_span_pages") == 0) {
+      release_span_pages = (value != 0);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.adaptive_span_pages") == 0) {
+      adaptive_span_pages = (value != 0);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.deferred_coalescing") == 0) {
+      deferred_coalescing = (value != 0);
+      if (!deferred_coalescing) {
+        // Do not leave spans behind that nobody will coalesce soon
+        for (int i = 0; i < kMaxPageHeaps; i++) {
+          TCMalloc_PageHeap* heap = pageheaps[i];
+          if (heap == NULL) continue;
+          SpinLockHolder h(&heap->lock_);
+          heap->CoalesceDeferred();
+        }
+      }
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_trace") == 0) {
+      SpinLockHolder l(&pageheap_lock);
+      return SetPageHeapTrace(value != 0);
+    }
+
+    if (strcmp(name, "tcmalloc.heap_huge_pages") == 0) {
+      if (value > kHugePagesNever) return false;
+      heap_huge_pages = static_cast<int>(value);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.metadata_huge_pages") == 0) {
+      if (value > kHugePagesNever) return false;
+      metadata_huge_pages = static_cast<int>(value);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.heap_soft_limit") == 0) {
+      heap_soft_limit = value;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.heap_hard_limit") == 0) {
+      heap_hard_limit = value;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.size_histogram") == 0) {
+      SpinLockHolder l(&threadheap_lock);
+      if (value != 0 && !size_histogram_enabled) {
+        // Start a new recording
+        ClearSizeHistograms();
+      }
+      size_histogram_enabled = (value != 0);
+      return true;
+    }
+
     return false;
   }
+
+  virtual bool DumpPageHeapTrace(const char* filename) {
+    ASSERT(filename != NULL);
+    return WritePageHeapTrace(filename);
+  }
+
+  virtual bool PrefaultHeap(size_t bytes) {
+    if (bytes == 0) return true;
+    TCMalloc_PageHeap* heap = LocalPageHeap();
+    const Length n = pages(bytes);
+    Span* span;
+    { // scope
+      SpinLockHolder h(&heap->lock_);
+      span = heap->New(n);
+    }
+    if (span == NULL) return false;
+    // The span is ours until it is deleted, so the pages can be
+    // touched without holding lock_.  Deleting it must then not give
+    // them back to the system again.
+    TCMalloc_SystemPrefault(reinterpret_cast<void*>(span->start << kPageShift),
+                            n << kPageShift);
+    SpinLockHolder h(&heap->lock_);
+    heap->Delete(span, false);
+    return true;
+  }
+
+  virtual bool PopulateSizeClass(size_t size, int objects) {
+    if (size > kMaxSize) return false;
+    // More than a thread cache holds for one class would mostly sit
+    // in the central cache unused
+    if (objects > kMaxFreeListLength) objects = kMaxFreeListLength;
+    TCMalloc_Central_FreeList* list = &central_cache[SizeClass(size)];
+    SpinLockHolder h(&list->lock_);
+    while (list->length() < objects) {
+      const int before = list->length();
+      list->Populate();         // Temporarily releases lock_
+      if (list->length() <= before) return false;
+    }
+    return true;
+  }
+
+  virtual void ReleaseFreeMemory() {
+    ReleasePageHeaps(~static_cast<Length>(0));    // All of it
+  }
+
+  virtual SysAllocator* GetSystemAllocator() {
+    return TCMalloc_GetSystemAllocator();
+  }
+
+  virtual bool SetSystemAllocator(SysAllocator* allocator) {
+    ASSERT(allocator != NULL);
+    TCMalloc_SetSystemAllocator(allocator);
+    return true;
+  }
 };
 
 
@@ -1706,15 +3842,29 @@ static TCMallocGuard module_enter_exit_hook;
 // Helpers for the exported routines below
 //-------------------------------------------------------------------
 
-static Span* DoSampledAllocation(size_t size) {
-  SpinLockHolder h(&pageheap_lock);
+static Span* DoSampledAllocation(TCMalloc_ThreadCache* heap, size_t size) {
+  // Take the stack trace before acquiring any locks: some
+  // GetStackTrace() implementations allocate memory.
+  void* pcs[kMaxStackDepth];
+  const int depth = GetStackTrace(pcs, kMaxStackDepth, 2);
 
   // Allocate span
-  Span* span = pageheap->New(pages(size == 0 ? 1 : size));
-  if (span == NULL) {
-    return NULL;
+  const Length n = pages(size == 0 ? 1 : size);
+  Span* span;
+  void* cached = heap->AllocateLarge(n);
+  if (cached != NULL) {
+    span = GetDescriptor(reinterpret_cast<uintptr_t>(cached) >> kPageShift);
+  } else {
+    TCMalloc_PageHeap* pageheap = LocalPageHeap();
+    SpinLockHolder h(&pageheap->lock_);
+    span = pageheap->New(n);
+    if (span == NULL) {
+      return NULL;
+    }
   }
 
+  SpinLockHolder h(&sample_lock);
+
   // Allocate stack trace
   StackTrace* stack = stacktrace_allocator.New();
   if (stack == NULL) {
@@ -1723,7 +3873,8 @@ static Span* DoSampledAllocation(size_t size) {
   }
 
   // Fill stack trace and record properly
-  stack->depth = GetStackTrace(stack->stack, kMaxStackDepth, 2);
+  stack->depth = depth;
+  memcpy(stack->stack, pcs, depth * sizeof(pcs[0]));
   stack->size = size;
   span->sample = 1;
   span->objects = stack;
@@ -1738,13 +3889,19 @@ static inline void* do_malloc(size_t size) {
     MESSAGE("In tcmalloc do_malloc(%" PRIuS")\n", size);
   // The following call forces module initialization
   TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCache();
+  if (size_histogram_enabled) heap->RecordSize(size);
   if (heap->SampleAllocation(size)) {
-    Span* span = DoSampledAllocation(size);
+    Span* span = DoSampledAllocation(heap, size);
     if (span == NULL) return NULL;
     return reinterpret_cast<void*>(span->start << kPageShift);
   } else if (size > kMaxSize) {
+    // Try the thread's cache of page-level spans before locking
+    void* result = heap->AllocateLarge(pages(size));
+    if (result != NULL) return result;
+
     // Use page-level allocator
-    SpinLockHolder h(&pageheap_lock);
+    TCMalloc_PageHeap* pageheap = LocalPageHeap();
+    SpinLockHolder h(&pageheap->lock_);
     Span* span = pageheap->New(pages(size));
     if (span == NULL) return NULL;
     return reinterpret_cast<void*>(span->start << kPageShift);
@@ -1757,14 +3914,14 @@ static inline void do_free(void* ptr) {
   if (TCMallocDebug::level >= TCMallocDebug::kVerbose) 
     MESSAGE("In tcmalloc do_free(%p)\n", ptr);
   if (ptr == NULL) return;
-  ASSERT(pageheap != NULL);  // Should not call free() before malloc()
+  ASSERT(pagemap != NULL);  // Should not call free() before malloc()
   const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
-  Span* span = pageheap->GetDescriptor(p);
-  ASSERT(span != NULL);
-  ASSERT(!span->free);
-  const size_t cl = span->sizeclass;
+  const size_t cl = GetSizeClass(p);
+  ASSERT(GetDescriptor(p) != NULL);
+  ASSERT(!GetDescriptor(p)->free);
+  ASSERT(GetDescriptor(p)->sizeclass == cl);
   if (cl != 0) {
-    ASSERT(!span->sample);
+    ASSERT(!GetDescriptor(p)->sample);
     TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCacheIfPresent();
     if (heap != NULL) {
       heap->Deallocate(ptr, cl);
@@ -1774,15 +3931,19 @@ static inline void do_free(void* ptr) {
       central_cache[cl].Insert(ptr);
     }
   } else {
-    SpinLockHolder h(&pageheap_lock);
+    Span* span = GetDescriptor(p);
     ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
     ASSERT(span->start == p);
     if (span->sample) {
+      SpinLockHolder h(&sample_lock);
       DLL_Remove(span);
       stacktrace_allocator.Delete(reinterpret_cast<StackTrace*>(span->objects));
       span->objects = NULL;
+      span->sample = 0;
     }
-    pageheap->Delete(span);
+    TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCacheIfPresent();
+    if (heap != NULL && heap->DeallocateLarge(span)) return;
+    ReturnToPageHeap(span);
   }
 }
 
@@ -1796,7 +3957,7 @@ static inline void do_free(void* ptr) {
 static void* do_memalign(size_t align, size_t size) {
   ASSERT((align & (align - 1)) == 0);
   ASSERT(align > 0);
-  if (pageheap == NULL) TCMalloc_ThreadCache::InitModule();
+  if (pagemap == NULL) TCMalloc_ThreadCache::InitModule();
 
   // Allocate at least one byte to avoid boundary conditions below
   if (size == 0) size = 1;
@@ -1819,20 +3980,21 @@ static void* do_memalign(size_t align, size_t size) {
   }
 
   // We will allocate directly from the page heap
-  SpinLockHolder h(&pageheap_lock);
+  TCMalloc_PageHeap* heap = LocalPageHeap();
+  SpinLockHolder h(&heap->lock_);
 
   if (align <= kPageSize) {
     // Any page-level allocation will be fine
     // TODO: We could put the rest of this page in the appropriate
     // TODO: cache but it does not seem worth it.
-    Span* span = pageheap->New(pages(size));
+    Span* span = heap->New(pages(size));
     if (span == NULL) return NULL;
     return reinterpret_cast<void*>(span->start << kPageShift);
   }
 
   // Allocate extra pages and carve off an aligned portion
   const int alloc = pages(size + align);
-  Span* span = pageheap->New(alloc);
+  Span* span = heap->New(alloc);
   if (span == NULL) return NULL;
 
   // Skip starting portion so that we end up aligned
@@ -1842,8 +4004,8 @@ static void* do_memalign(size_t align, size_t size) {
   }
   ASSERT(skip < alloc);
   if (skip > 0) {
-    Span* rest = pageheap->Split(span, skip);
-    pageheap->Delete(span);
+    Span* rest = heap->Split(span, skip);
+    heap->Delete(span);
     span = rest;
   }
 
@@ -1851,8 +4013,8 @@ static void* do_memalign(size_t align, size_t size) {
   const int needed = pages(size);
   ASSERT(span->length >= needed);
   if (span->length > needed) {
-    Span* trailer = pageheap->Split(span, needed);
-    pageheap->Delete(trailer);
+    Span* trailer = heap->Split(span, needed);
+    heap->Delete(trailer);
   }
   return reinterpret_cast<void*>(span->start << kPageShift);
 }
@@ -1905,12 +4067,12 @@ extern "C" void* realloc(void* old_ptr, size_t new_size) {
 
   // Get the size of the old entry
   const PageID p = reinterpret_cast<uintptr_t>(old_ptr) >> kPageShift;
-  Span* span = pageheap->GetDescriptor(p);
+  const size_t cl = GetSizeClass(p);
   size_t old_size;
-  if (span->sizeclass != 0) {
-    old_size = ByteSizeForClass(span->sizeclass);
+  if (cl != 0) {
+    old_size = ByteSizeForClass(cl);
   } else {
-    old_size = span->length << kPageShift;
+    old_size = static_cast<size_t>(GetDescriptor(p)->length) << kPageShift;
   }
 
   // Reallocate if the new size is larger than the old size,
@@ -1939,12 +4101,26 @@ extern "C" void* realloc(void* old_ptr, size_t new_size) {
 #define OPDELETE_THROW throw()
 #endif
 
-void* operator new(size_t size) OPNEW_THROW {
-  void* p = do_malloc(size);
-  if (p == NULL) {
-    MESSAGE("Unable to allocate %" PRIuS " bytes: new failed\n", size);
-    abort();
+// Allocation for operator new.  As the standard asks, a failed
+// allocation (e.g., at heap_hard_limit) calls the new_handler and
+// tries again until the handler gives up.  Without a handler we abort.
+static inline void* do_new(size_t size) {
+  for (;;) {
+    void* p = do_malloc(size);
+    if (p != NULL) return p;
+    // The handler can only be read by replacing it
+    std::new_handler handler = std::set_new_handler(NULL);
+    std::set_new_handler(handler);
+    if (handler == NULL) {
+      MESSAGE("Unable to allocate %" PRIuS " bytes: new failed\n", size);
+      abort();
+    }
+    (*handler)();
   }
+}
+
+void* operator new(size_t size) OPNEW_THROW {
+  void* p = do_new(size);
   MallocHook::InvokeNewHook(p, size);
   return p;
 }
@@ -1955,11 +4131,7 @@ void operator delete(void* p) OPDELETE_THROW {
 }
 
 void* operator new[](size_t size) OPNEW_THROW {
-  void* p = do_malloc(size);
-  if (p == NULL) {
-    MESSAGE("Unable to allocate %" PRIuS " bytes: new failed\n", size);
-    abort();
-  }
+  void* p = do_new(size);
   MallocHook::InvokeNewHook(p, size);
   return p;
 }
@@ -0,0 +1,123 @@
+// Copyright (c) 2005, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Compares the page map representations for 64-bit machines with
+// 48-bit user addresses by the cost of the lookups free() does: the
+// size class of the page and, for page-level blocks, the descriptor.
+//
+// Usage: pagemap_benchmark [-n lookups] [-m heap_megabytes]
+//
+// The heap is laid out like a typical process: half of it just above
+// the program (where sbrk() puts it) and half of it near the top of
+// the address space (where mmap() puts it).  Lookups go to random
+// pages of the heap.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "pagemap.h"
+
+static const int kPageShift = 12;
+static const int kBits = 48 - kPageShift;
+
+static long num_lookups = 10000000;
+static size_t heap_megabytes = 1024;
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Allocator for the maps that keeps track of how much they use
+static size_t allocated_bytes = 0;
+static void* CountingAlloc(size_t bytes) {
+  allocated_bytes += bytes;
+  return malloc(bytes);
+}
+
+template <class Map>
+static void Run(const char* name) {
+  allocated_bytes = 0;
+  Map map(CountingAlloc);
+
+  const uintptr_t pages = (heap_megabytes << 20) >> kPageShift;
+  const uintptr_t low = 0x01000000 >> kPageShift;
+  const uintptr_t high = (0x7f0000000000ULL >> kPageShift) - pages / 2;
+  if (!map.Ensure(low, pages / 2) || !map.Ensure(high, pages / 2)) {
+    printf("%-8s cannot be set up\n", name);
+    return;
+  }
+  // Every eighth page is the start of a page-level block
+  for (uintptr_t i = 0; i < pages / 2; i++) {
+    map.set(low + i, reinterpret_cast<void*>(i));
+    map.set(high + i, reinterpret_cast<void*>(i));
+    map.set_sizeclass(low + i, (i % 8 == 0) ? 0 : 1 + i % 100);
+    map.set_sizeclass(high + i, (i % 8 == 0) ? 0 : 1 + i % 100);
+  }
+
+  unsigned int rnd = 1;
+  uintptr_t sum = 0;
+  const double start = Now();
+  for (long i = 0; i < num_lookups; i++) {
+    rnd = rnd * 1103515245 + 12345;
+    const uintptr_t r = (rnd >> 4) % pages;
+    const uintptr_t p = (r < pages / 2) ? low + r : high + r - pages / 2;
+    const int cl = map.sizeclass(p);
+    if (cl == 0) {
+      sum += reinterpret_cast<uintptr_t>(map.get(p));
+    } else {
+      sum += cl;
+    }
+  }
+  const double elapsed = Now() - start;
+  printf("%-8s %8.2f ns/free %10.1f MB allocated   (checksum %lu)\n",
+         name, elapsed / num_lookups * 1e9, allocated_bytes / 1048576.0,
+         static_cast<unsigned long>(sum));
+}
+
+int main(int argc, char** argv) {
+  for (int arg = 1; arg + 1 < argc; arg += 2) {
+    if (strcmp(argv[arg], "-n") == 0) {
+      num_lookups = atol(argv[arg+1]);
+    } else if (strcmp(argv[arg], "-m") == 0) {
+      heap_megabytes = atol(argv[arg+1]);
+    } else {
+      fprintf(stderr, "Unknown flag %s\n", argv[arg]);
+      return 1;
+    }
+  }
+  Run<TCMalloc_PageMap3<kBits> >("3-level");
+  Run<TCMalloc_PageMap2<kBits> >("2-level");
+  Run<TCMalloc_PageMapFlat<kBits> >("flat");
+  return 0;
+}
@@ -0,0 +1,88 @@
+#!/bin/sh
+
+# Copyright (c) 2005, Google Inc.
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+# 
+#     * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above
+# copyright notice, this list of conditions and the following disclaimer
+# in the documentation and/or other materials provided with the
+# distribution.
+#     * Neither the name of Google Inc. nor the names of its
+# contributors may be used to endorse or promote products derived from
+# this software without specific prior written permission.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+
+# ---
+# Picks size classes for a fixed allocation size histogram, mostly of
+# 72, 136 and 520 byte objects, and makes sure that they waste less
+# memory to rounding up than the default classes: at most 1% of the
+# requested bytes instead of more than 5%.  With only 8 classes to
+# choose, they must still waste less than the default ones.
+#
+# Takes two arguments: the directory holding size_class_gen, and the
+# directory holding size_class_histogram.txt.
+
+if [ -z "$2" ]
+then
+    echo "USAGE: $0 <size_class_gen dir> <histogram dir>"
+    exit 1
+fi
+
+SIZE_CLASS_GEN=$1/size_class_gen
+HISTOGRAM=$2/size_class_histogram.txt
+TMPDIR=/tmp/size_class_gen.$$
+mkdir -p $TMPDIR || exit 1
+
+# Runs size_class_gen with the histogram and the arguments given, and
+# sets DEFAULT and CUSTOM to the rounding waste, in percent, of the
+# default and the new classes, and CLASSES to the number of new classes
+Generate() {
+    if ! $SIZE_CLASS_GEN --histogram $HISTOGRAM "$@" \
+           > $TMPDIR/classes 2> $TMPDIR/summary; then
+        cat $TMPDIR/summary
+        echo "size_class_gen $* failed"
+        exit 1
+    fi
+    DEFAULT=`sed -n 's/.* default [0-9]* bytes (\([0-9.]*\)%).*/\1/p' \
+             $TMPDIR/summary`
+    CUSTOM=`sed -n 's/.* custom [0-9]* bytes (\([0-9.]*\)%).*/\1/p' \
+            $TMPDIR/summary`
+    CLASSES=`grep -v '^#' $TMPDIR/classes | wc -w`
+    echo "size_class_gen --histogram $HISTOGRAM${1:+ $*}:" \
+         "default $DEFAULT%, custom $CUSTOM%, $CLASSES classes"
+}
+
+# Exits with an error unless the awk condition $1 holds
+Expect() {
+    if ! awk -v default="$DEFAULT" -v custom="$CUSTOM" -v classes="$CLASSES" \
+             "BEGIN { exit !($1) }"; then
+        echo "FAILED: expected $1"
+        rm -rf $TMPDIR
+        exit 1
+    fi
+}
+
+Generate
+Expect "default > 5 && custom <= 1"
+
+Generate --classes 8
+Expect "classes <= 8 && custom < default"
+
+rm -rf $TMPDIR
+echo "PASS"
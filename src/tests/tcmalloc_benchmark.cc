@@ -0,0 +1,327 @@
+// Copyright (c) 2005, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Multi-threaded micro-benchmarks for tcmalloc internals.
+//
+// Usage: tcmalloc_benchmark [-t threads] [-n iterations] [-s shards]
+//                           [-p property=value] [benchmark...]
+// With no benchmark names, all benchmarks are run.  Each benchmark
+// prints the wall-clock time and the number of operations per second
+// summed over all threads, and the heap size afterwards.
+//
+// tcmalloc_large_pages_benchmark is the same program linked with the
+// large page variant of the library; run both to compare page sizes.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include "google/malloc_interface.h"
+
+static int num_threads = 4;
+static int num_iterations = 100000;
+static int num_shards = 0;      // Page heap shards; 0 leaves the default
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double NowMonotonic() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Cheap per-thread random numbers
+static inline unsigned int NextRandom(unsigned int* state) {
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+// -------------------------------------------------------------------
+// "mixed": every thread interleaves the operations that used to
+// serialize on a single page heap lock: small allocations (some of
+// which are sampled), large allocations, stats collection and the
+// creation and destruction of short-lived threads.
+// -------------------------------------------------------------------
+
+static void* ShortLivedThread(void* arg) {
+  // Creates and destroys a thread cache
+  free(malloc(16));
+  return NULL;
+}
+
+static void* MixedWorker(void* arg) {
+  unsigned int rnd = reinterpret_cast<size_t>(arg);
+  static const int kSlots = 64;
+  void* slots[kSlots];
+  memset(slots, 0, sizeof(slots));
+  char stats[4096];
+
+  for (int i = 0; i < num_iterations; i++) {
+    const unsigned int r = NextRandom(&rnd);
+    const int slot = r % kSlots;
+    free(slots[slot]);
+    switch (r % 100) {
+      case 0:
+        MallocInterface::instance()->GetStats(stats, sizeof(stats));
+        slots[slot] = NULL;
+        break;
+      case 1: {
+        pthread_t t;
+        pthread_create(&t, NULL, ShortLivedThread, NULL);
+        pthread_join(t, NULL);
+        slots[slot] = NULL;
+        break;
+      }
+      default:
+        if (r % 10 == 0) {
+          // Large: bigger than anything cached per thread
+          slots[slot] = malloc((520 << 10) + (r % 64) * 4096);
+        } else {
+          slots[slot] = malloc(r % 2048);
+        }
+        break;
+    }
+  }
+  for (int i = 0; i < kSlots; i++) free(slots[i]);
+  return NULL;
+}
+
+// -------------------------------------------------------------------
+// "large": every thread allocates and frees page-level blocks that are
+// too big for the thread span caches, so each operation goes to the
+// page heap.  Run with increasing "-s" to see the effect of sharding.
+// -------------------------------------------------------------------
+
+static void* LargeWorker(void* arg) {
+  unsigned int rnd = reinterpret_cast<size_t>(arg);
+  static const int kSlots = 16;
+  void* slots[kSlots];
+  memset(slots, 0, sizeof(slots));
+
+  for (int i = 0; i < num_iterations; i++) {
+    const unsigned int r = NextRandom(&rnd);
+    const int slot = r % kSlots;
+    free(slots[slot]);
+    slots[slot] = malloc((520 << 10) + (r % 128) * 4096);
+  }
+  for (int i = 0; i < kSlots; i++) free(slots[i]);
+  return NULL;
+}
+
+// -------------------------------------------------------------------
+// "medium": every thread allocates and frees blocks between 32KB and
+// 256KB, the range of typical I/O and serialization buffers.  Like
+// such buffers, each slot is re-allocated with about the same size.
+// -------------------------------------------------------------------
+
+static void* MediumWorker(void* arg) {
+  unsigned int rnd = reinterpret_cast<size_t>(arg);
+  static const int kSlots = 8;
+  void* slots[kSlots];
+  memset(slots, 0, sizeof(slots));
+
+  for (int i = 0; i < num_iterations; i++) {
+    const unsigned int r = NextRandom(&rnd);
+    const int slot = r % kSlots;
+    free(slots[slot]);
+    slots[slot] = malloc((32 << 10) + slot * (28 << 10) + (r >> 4) % 1024);
+  }
+  for (int i = 0; i < kSlots; i++) free(slots[i]);
+  return NULL;
+}
+
+// -------------------------------------------------------------------
+// "pageheap": stresses the page heap itself with frees and
+// re-allocations of the same page-level lengths, all bigger than the
+// thread span caches.  Also reports how long single calls take; as
+// nearly all of that time is spent holding a page heap lock, the
+// average and maximum approximate the lock hold time.  Compare runs
+// with and without "-p tcmalloc.deferred_coalescing=1".
+// -------------------------------------------------------------------
+
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double latency_total = 0;
+static double latency_max = 0;
+static long latency_count = 0;
+
+static void* PageHeapWorker(void* arg) {
+  unsigned int rnd = reinterpret_cast<size_t>(arg);
+  static const int kSlots = 32;
+  void* slots[kSlots];
+  memset(slots, 0, sizeof(slots));
+  double total = 0;
+  double max = 0;
+
+  for (int i = 0; i < num_iterations; i++) {
+    const unsigned int r = NextRandom(&rnd);
+    const int slot = r % kSlots;
+    // Each slot is re-allocated with the same length; a handful of
+    // lengths between 129 and 255 pages
+    const size_t size = (129 + (slot % 4) * 40) * 4096;
+    const double start = NowMonotonic();
+    free(slots[slot]);
+    slots[slot] = malloc(size);
+    const double elapsed = NowMonotonic() - start;
+    total += elapsed;
+    if (elapsed > max) max = elapsed;
+  }
+  for (int i = 0; i < kSlots; i++) free(slots[i]);
+
+  pthread_mutex_lock(&latency_mutex);
+  latency_total += total;
+  latency_count += num_iterations;
+  if (max > latency_max) latency_max = max;
+  pthread_mutex_unlock(&latency_mutex);
+  return NULL;
+}
+
+// -------------------------------------------------------------------
+// "growth": every thread allocates page-level blocks and keeps them, so
+// that the heap has to grow all the time.  Run with "-s" set to the
+// number of threads so that the threads grow different page heap
+// partitions at once and only meet in the system allocator.  The heap
+// grows by about threads * iterations / 100 MB.
+// -------------------------------------------------------------------
+
+static void* GrowthWorker(void* arg) {
+  unsigned int rnd = reinterpret_cast<size_t>(arg);
+  const int blocks = num_iterations / 100 > 0 ? num_iterations / 100 : 1;
+  char** slots = new char*[blocks];
+  for (int i = 0; i < blocks; i++) {
+    const unsigned int r = NextRandom(&rnd);
+    slots[i] = reinterpret_cast<char*>(malloc((1 << 20) + (r % 64) * 4096));
+    if (slots[i] != NULL) slots[i][0] = 1;
+  }
+  for (int i = 0; i < blocks; i++) free(slots[i]);
+  delete[] slots;
+  return NULL;
+}
+
+// -------------------------------------------------------------------
+// Benchmark driver
+// -------------------------------------------------------------------
+
+struct Benchmark {
+  const char* name;
+  void* (*worker)(void*);
+};
+
+static const Benchmark kBenchmarks[] = {
+  { "mixed", MixedWorker },
+  { "large", LargeWorker },
+  { "medium", MediumWorker },
+  { "pageheap", PageHeapWorker },
+  { "growth", GrowthWorker },
+};
+static const int kNumBenchmarks = sizeof(kBenchmarks) / sizeof(kBenchmarks[0]);
+
+static void RunBenchmark(const Benchmark& b) {
+  latency_total = latency_max = 0;
+  latency_count = 0;
+  pthread_t* threads = new pthread_t[num_threads];
+  const double start = Now();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, b.worker,
+                   reinterpret_cast<void*>(static_cast<size_t>(i + 1)));
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  const double elapsed = Now() - start;
+  delete[] threads;
+  printf("%-16s %3d threads %10d iters %8.3f s %12.0f ops/s\n",
+         b.name, num_threads, num_iterations, elapsed,
+         (static_cast<double>(num_threads) * num_iterations) / elapsed);
+  if (latency_count > 0) {
+    printf("%-16s free+malloc: %8.0f ns avg %10.0f ns max\n", "",
+           latency_total / latency_count * 1e9, latency_max * 1e9);
+  }
+  size_t page_size, heap_size;
+  if (MallocInterface::instance()->GetNumericProperty("tcmalloc.page_size",
+                                                      &page_size) &&
+      MallocInterface::instance()->GetNumericProperty("generic.heap_size",
+                                                      &heap_size)) {
+    printf("%-16s %3d KB pages: %8.1f MB heap\n", "",
+           static_cast<int>(page_size >> 10), heap_size / 1048576.0);
+  }
+}
+
+int main(int argc, char** argv) {
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg += 2) {
+    if (arg + 1 >= argc) break;
+    if (strcmp(argv[arg], "-t") == 0) {
+      num_threads = atoi(argv[arg+1]);
+    } else if (strcmp(argv[arg], "-n") == 0) {
+      num_iterations = atoi(argv[arg+1]);
+    } else if (strcmp(argv[arg], "-s") == 0) {
+      num_shards = atoi(argv[arg+1]);
+    } else if (strcmp(argv[arg], "-p") == 0) {
+      char* name = argv[arg+1];
+      char* value = strchr(name, '=');
+      if (value == NULL) {
+        fprintf(stderr, "Expected -p property=value\n");
+        return 1;
+      }
+      *value++ = '\0';
+      if (!MallocInterface::instance()->SetNumericProperty(name,
+                                                           atol(value))) {
+        fprintf(stderr, "Cannot set %s\n", name);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Unknown flag %s\n", argv[arg]);
+      return 1;
+    }
+  }
+
+  if (num_shards > 0 &&
+      !MallocInterface::instance()->SetNumericProperty(
+          "tcmalloc.pageheap_shards", num_shards)) {
+    fprintf(stderr, "Cannot set the number of page heap shards\n");
+    return 1;
+  }
+
+  for (int b = 0; b < kNumBenchmarks; b++) {
+    bool selected = (arg == argc);
+    for (int i = arg; i < argc; i++) {
+      if (strcmp(argv[i], kBenchmarks[b].name) == 0) selected = true;
+    }
+    if (selected) RunBenchmark(kBenchmarks[b]);
+  }
+  return 0;
+}
@@ -32,13 +32,983 @@
 //
 // TODO(menage) Turn this into a real unittest ...
 
+#include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <new>
 #include "google/malloc_interface.h"
 
 #define BUFSIZE (100 << 10)
 
+#define CHECK(cond)  do {                                        \
+  if (!(cond)) {                                                 \
+    fprintf(stderr, "%s:%d: check failed: %s\n",                 \
+            __FILE__, __LINE__, #cond);                          \
+    exit(1);                                                     \
+  }                                                              \
+} while (0)
+
+static const int kNumaThreads = 4;
+static const int kNumaBlocks = 64;
+
+static void* AllocateLargeBlocks(void* arg) {
+  void** blocks = reinterpret_cast<void**>(arg);
+  for (int i = 0; i < kNumaBlocks; i++) {
+    // Bigger than the largest size class
+    blocks[i] = malloc((260 << 10) + i * 4096);
+    CHECK(blocks[i] != NULL);
+    memset(blocks[i], i, BUFSIZE);
+  }
+  return NULL;
+}
+
+// Heap size of the page heap partitions of node slot "node" as listed
+// in the stats, or 0 if they are not listed
+static size_t NodeHeapSize(int node) {
+  static char buffer[64 << 10];
+  MallocInterface::instance()->GetStats(buffer, sizeof(buffer));
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "MALLOC: node %d:", node);
+  const char* line = strstr(buffer, prefix);
+  unsigned long long bytes;
+  if (line == NULL || sscanf(line + strlen(prefix), "%llu", &bytes) != 1) {
+    return 0;
+  }
+  return bytes;
+}
+
+// Force two page heap partitions (more than this machine may have
+// nodes) of four shards each and check that memory allocated by
+// several threads can be freed from another thread and reused.
+static void TestNumaPartitions() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t old_partitions;
+  if (!mi->GetNumericProperty("tcmalloc.numa_partitions", &old_partitions)) {
+    return;     // Not running on tcmalloc
+  }
+  size_t old_shards;
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_shards", &old_shards));
+  CHECK(mi->SetNumericProperty("tcmalloc.numa_partitions", 2));
+  CHECK(mi->SetNumericProperty("tcmalloc.pageheap_shards", 4));
+  size_t partitions, shards;
+  CHECK(mi->GetNumericProperty("tcmalloc.numa_partitions", &partitions));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_shards", &shards));
+  CHECK(partitions == 2);
+  CHECK(shards == 4);
+
+  // Threads pick a partition by cpu and stack address, so a round may
+  // leave the second one unused, or only used by a thread that moved
+  // to another cpu halfway; keep going until a thread's blocks fit
+  const size_t kThreadBytes = kNumaBlocks * (260 << 10);
+  for (int round = 0; round < 2 || NodeHeapSize(1) < kThreadBytes; round++) {
+    CHECK(round < 64);
+    static void* blocks[kNumaThreads][kNumaBlocks];
+    pthread_t threads[kNumaThreads];
+    for (int t = 0; t < kNumaThreads; t++) {
+      pthread_create(&threads[t], NULL, AllocateLargeBlocks, blocks[t]);
+    }
+    for (int t = 0; t < kNumaThreads; t++) {
+      pthread_join(threads[t], NULL);
+    }
+    for (int t = 0; t < kNumaThreads; t++) {
+      for (int i = 0; i < kNumaBlocks; i++) {
+        CHECK(reinterpret_cast<unsigned char*>(blocks[t][i])[0] == i);
+        free(blocks[t][i]);
+      }
+    }
+  }
+
+  CHECK(NodeHeapSize(0) > 0);
+  CHECK(NodeHeapSize(1) >= kThreadBytes);
+  CHECK(mi->SetNumericProperty("tcmalloc.numa_partitions", old_partitions));
+  CHECK(mi->SetNumericProperty("tcmalloc.pageheap_shards", old_shards));
+}
+
+// Repeatedly freeing and re-allocating a page-level block should be
+// served from the thread's span cache, i.e., hand back the same block.
+static void TestLargeSpanReuse() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t cached;
+  if (!mi->GetNumericProperty("tcmalloc.current_total_thread_span_cache_bytes",
+                              &cached)) {
+    return;     // Not running on tcmalloc
+  }
+  const int kIters = 100;
+  const size_t kSize = 300 << 10;
+  void* last = malloc(kSize);
+  int reused = 0;
+  for (int i = 0; i < kIters; i++) {
+    free(last);
+    void* p = malloc(kSize);
+    if (p == last) reused++;
+    last = p;
+  }
+  free(last);
+  // Sampled allocations go through the cache as well; allow a few
+  // misses in case the cache is trimmed in between
+  CHECK(reused >= kIters / 2);
+  CHECK(mi->GetNumericProperty("tcmalloc.current_total_thread_span_cache_bytes",
+                               &cached));
+  CHECK(cached >= kSize);
+
+  // Cached spans and small objects share the thread cache budget
+  size_t old_limit, small;
+  CHECK(mi->GetNumericProperty("tcmalloc.max_total_thread_cache_bytes",
+                               &old_limit));
+  CHECK(mi->SetNumericProperty("tcmalloc.max_total_thread_cache_bytes",
+                               1 << 20));
+  static const int kBlocks = 16;
+  void* small_blocks[2 * kBlocks * 4];
+  void* large_blocks[kBlocks];
+  for (int i = 0; i < 2 * kBlocks * 4; i++) {
+    small_blocks[i] = malloc((i % 2 == 0) ? 4000 : 8000);
+  }
+  for (int i = 0; i < kBlocks; i++) large_blocks[i] = malloc(kSize);
+  for (int i = 0; i < 2 * kBlocks * 4; i++) free(small_blocks[i]);
+  for (int i = 0; i < kBlocks; i++) free(large_blocks[i]);
+  CHECK(mi->GetNumericProperty("tcmalloc.current_total_thread_cache_bytes",
+                               &small));
+  CHECK(mi->GetNumericProperty("tcmalloc.current_total_thread_span_cache_bytes",
+                               &cached));
+  CHECK(small + cached <= (1 << 20));
+  CHECK(mi->SetNumericProperty("tcmalloc.max_total_thread_cache_bytes",
+                               old_limit));
+}
+
+static int ComparePointers(const void* a, const void* b) {
+  const char* x = *reinterpret_cast<char* const*>(a);
+  const char* y = *reinterpret_cast<char* const*>(b);
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+// With address-ordered allocation, a page-level allocation should
+// reuse the lowest free block rather than the one freed last, also
+// when the blocks were freed before the policy was turned on.
+static void TestAddressOrderedAllocation() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t old_policy;
+  if (!mi->GetNumericProperty("tcmalloc.address_ordered_allocation",
+                              &old_policy)) {
+    return;     // Not running on tcmalloc
+  }
+  CHECK(mi->SetNumericProperty("tcmalloc.address_ordered_allocation", 0));
+
+  // Too big for the thread span caches.  Every other block is freed,
+  // lowest first, so that the free ones cannot merge and the one freed
+  // last is the highest.
+  const size_t kSize = 600 << 10;
+  static const int kBlocks = 12;
+  char* blocks[kBlocks];
+  for (int i = 0; i < kBlocks; i++) {
+    blocks[i] = static_cast<char*>(malloc(kSize));
+  }
+  qsort(blocks, kBlocks, sizeof(blocks[0]), ComparePointers);
+  for (int i = 1; i < kBlocks; i += 2) free(blocks[i]);
+
+  CHECK(mi->SetNumericProperty("tcmalloc.address_ordered_allocation", 1));
+  char* p = static_cast<char*>(malloc(kSize));
+  CHECK(p <= blocks[1]);
+  free(p);
+
+  // Blocks freed while the policy is on are reused lowest first too
+  char* q = static_cast<char*>(malloc(kSize));
+  CHECK(q <= blocks[1]);
+  free(blocks[kBlocks - 2]);
+  free(q);
+  p = static_cast<char*>(malloc(kSize));
+  CHECK(p == q);
+  free(p);
+  for (int i = 0; i < kBlocks - 2; i += 2) free(blocks[i]);
+  CHECK(mi->SetNumericProperty("tcmalloc.address_ordered_allocation",
+                               old_policy));
+}
+
+// Adjacent spans freed while coalescing is deferred are merged when
+// the deferral is turned off
+static void TestDeferredCoalescing() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t old_policy;
+  if (!mi->GetNumericProperty("tcmalloc.deferred_coalescing", &old_policy)) {
+    return;     // Not running on tcmalloc
+  }
+  CHECK(mi->SetNumericProperty("tcmalloc.deferred_coalescing", 0));
+
+  // Too big for the thread span caches, and a whole number of pages.
+  // A block comes from the smallest free span that fits, so blocks are
+  // taken until one comes from the region freed here; the rest of that
+  // span then holds the others, one after the other.  The blocks taken
+  // on the way are kept until the end.
+  const size_t kSize = 640 << 10;
+  static const int kBlocks = 5;
+  static const int kFillers = 4096;
+  static char* fillers[kFillers];
+  int fillers_used = 0;
+  char* region = static_cast<char*>(malloc(kBlocks * kSize));
+  const uintptr_t region_start = reinterpret_cast<uintptr_t>(region);
+  free(region);
+  char* b[kBlocks];
+  for (;;) {
+    b[0] = static_cast<char*>(malloc(kSize));
+    const uintptr_t start = reinterpret_cast<uintptr_t>(b[0]);
+    if (start >= region_start && start < region_start + kBlocks * kSize) {
+      break;
+    }
+    CHECK(fillers_used < kFillers);
+    fillers[fillers_used++] = b[0];
+  }
+  for (int i = 1; i < kBlocks; i++) {
+    b[i] = static_cast<char*>(malloc(kSize));
+    CHECK(b[i] == b[i - 1] + kSize);
+  }
+
+  // The inner blocks stay separate spans until the deferral ends; the
+  // outer ones keep them from merging with anything else
+  const uintptr_t inner_start = reinterpret_cast<uintptr_t>(b[1]);
+  size_t deferred;
+  CHECK(mi->SetNumericProperty("tcmalloc.deferred_coalescing", 1));
+  for (int i = 1; i < kBlocks - 1; i++) free(b[i]);
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_deferred_bytes",
+                               &deferred));
+  CHECK(deferred >= (kBlocks - 2) * kSize);
+  CHECK(mi->SetNumericProperty("tcmalloc.deferred_coalescing", 0));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_deferred_bytes",
+                               &deferred));
+  CHECK(deferred == 0);
+  char* p = static_cast<char*>(malloc((kBlocks - 2) * kSize));
+  CHECK(reinterpret_cast<uintptr_t>(p) == inner_start);
+  free(p);
+  free(b[0]);
+  free(b[kBlocks - 1]);
+  for (int i = 0; i < fillers_used; i++) free(fillers[i]);
+  CHECK(mi->SetNumericProperty("tcmalloc.deferred_coalescing", old_policy));
+}
+
+// Objects per span the fragmentation report lists for the class
+// that holds "size"-byte objects, or 0 if it is not listed.  The size
+// of the class goes to "*class_size" unless it is NULL.
+static size_t ObjectsPerSpan(size_t size, size_t* class_size) {
+  static char buffer[64 << 10];
+  MallocInterface::instance()->GetFragmentationReport(buffer, sizeof(buffer));
+  const char* line = strstr(buffer, "Size class fragmentation");
+  if (line == NULL) return 0;
+  line = strchr(line, '\n') + 1;     // Skip the column headers
+  for (line = strchr(line, '\n'); line != NULL; line = strchr(line, '\n')) {
+    line++;
+    int cl, spans;
+    unsigned long bytes, objects;
+    if (sscanf(line, "%d %lu %d %lu", &cl, &bytes, &spans, &objects) != 4) {
+      break;
+    }
+    if (bytes >= size) {
+      if (class_size != NULL) *class_size = bytes;
+      return objects;
+    }
+  }
+  return 0;
+}
+
+static const int kReleaseObjects = 1000;
+static int release_keep_every;
+
+static void* FreeMostObjects(void* arg) {
+  void** objects = reinterpret_cast<void**>(arg);
+  for (int i = 0; i < kReleaseObjects; i++) {
+    if (i % release_keep_every != 0) free(objects[i]);
+  }
+  return NULL;   // Thread exit returns the objects to the central cache
+}
+
+// Keeping a few objects of a size class whose spans have several pages
+// alive should let the central cache give the remaining pages of its
+// spans back to the system.
+static void TestReleaseSpanPages() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t old_setting;
+  if (!mi->GetNumericProperty("tcmalloc.release_span_pages", &old_setting)) {
+    return;     // Not running on tcmalloc
+  }
+  CHECK(mi->SetNumericProperty("tcmalloc.release_span_pages", 1));
+  size_t before, after;
+  CHECK(mi->GetNumericProperty("tcmalloc.span_released_bytes", &before));
+
+  // Look for the smallest class of the table in use whose spans hold
+  // two objects or more on two pages or more; custom classes may have
+  // none.  An object of the class has to be allocated for the report to
+  // list it.
+  size_t page_size;
+  CHECK(mi->GetNumericProperty("tcmalloc.page_size", &page_size));
+  size_t size = 0;
+  size_t per_span = 0;
+  for (size_t probe_size = 1; ; ) {
+    size_t class_size;
+    void* probe = malloc(probe_size);
+    per_span = ObjectsPerSpan(probe_size, &class_size);
+    free(probe);
+    if (per_span == 0) break;   // Past the largest class
+    if (per_span >= 2 && per_span * class_size > page_size) {
+      size = class_size;
+      break;
+    }
+    probe_size = class_size + 1;
+  }
+
+  // One object in every span and one more is kept, so in most spans the
+  // pages not under the kept object hold only free objects.  Without
+  // such a class, only the objects that stay are checked.
+  const size_t object_size = (size != 0) ? size : page_size * 3 / 8;
+  release_keep_every = (size != 0) ? per_span + 1 : 4;
+  CHECK(4 * release_keep_every <= kReleaseObjects);
+  static void* objects[kReleaseObjects];
+  for (int i = 0; i < kReleaseObjects; i++) {
+    objects[i] = malloc(object_size);
+    memset(objects[i], 1, object_size);
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, FreeMostObjects, objects);
+  pthread_join(thread, NULL);
+  CHECK(mi->GetNumericProperty("tcmalloc.span_released_bytes", &after));
+  if (size != 0) CHECK(after > before);
+
+  // The remaining objects must still be intact
+  for (int i = 0; i < kReleaseObjects; i += release_keep_every) {
+    CHECK(reinterpret_cast<unsigned char*>(objects[i])[object_size - 1] == 1);
+    free(objects[i]);
+  }
+  CHECK(mi->SetNumericProperty("tcmalloc.release_span_pages", old_setting));
+}
+
+// Page-level allocations show up in a dump of the page heap trace
+static void TestPageHeapTrace() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t old_setting;
+  if (!mi->GetNumericProperty("tcmalloc.pageheap_trace", &old_setting)) {
+    return;     // Not running on tcmalloc
+  }
+  CHECK(mi->SetNumericProperty("tcmalloc.pageheap_trace", 1));
+  void* blocks[4];
+  for (int i = 0; i < 4; i++) {
+    blocks[i] = malloc((1 << 20) + i * 8192);
+    CHECK(blocks[i] != NULL);
+  }
+  for (int i = 0; i < 4; i++) free(blocks[i]);
+  CHECK(mi->SetNumericProperty("tcmalloc.pageheap_trace", old_setting));
+
+  char filename[] = "/tmp/tcmalloc_unittest.XXXXXX";
+  const int fd = mkstemp(filename);
+  CHECK(fd >= 0);
+  close(fd);
+  CHECK(mi->DumpPageHeapTrace(filename));
+  FILE* f = fopen(filename, "r");
+  CHECK(f != NULL);
+  char line[128];
+  int allocations = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned long long time;
+    char op;
+    if (sscanf(line, "%llu %c", &time, &op) == 2 && op == 'A') allocations++;
+  }
+  fclose(f);
+  unlink(filename);
+  CHECK(allocations >= 4);
+}
+
+// The fragmentation report is only in GetFragmentationReport(), so
+// that GetStats() still fits the buffers its callers already use
+static void TestFragmentationReport() {
+  size_t value;
+  if (!MallocInterface::instance()->GetNumericProperty(
+          "tcmalloc.pageheap_top_free_bytes", &value)) {
+    return;     // Not running on tcmalloc
+  }
+  static char buffer[64 << 10];
+  MallocInterface::instance()->GetFragmentationReport(buffer, sizeof(buffer));
+  CHECK(strstr(buffer, "Size class fragmentation") != NULL);
+  CHECK(strstr(buffer, "fragmentation index") != NULL);
+  CHECK(strstr(buffer, "waste        bytes") != NULL);
+  MallocInterface::instance()->GetStats(buffer, sizeof(buffer));
+  CHECK(strstr(buffer, "Size class fragmentation") == NULL);
+}
+
+// Page-level allocations start on a page boundary
+static void TestPageSize() {
+  size_t page_size;
+  if (!MallocInterface::instance()->GetNumericProperty("tcmalloc.page_size",
+                                                       &page_size)) {
+    return;     // Not running on tcmalloc
+  }
+  CHECK(page_size >= 4096 && (page_size & (page_size - 1)) == 0);
+  void* p = malloc(1 << 20);
+  CHECK(p != NULL);
+  CHECK(reinterpret_cast<uintptr_t>(p) % page_size == 0);
+  free(p);
+}
+
+// Freeing a huge block should give back the pagemap leaves inside it,
+// and allocating it again should bring them back.
+static void TestPageMapRelease() {
+  size_t page_size, mapped, released, heap_released, heap_released_after;
+  MallocInterface* mi = MallocInterface::instance();
+  if (!mi->GetNumericProperty("tcmalloc.page_size", &page_size)) {
+    return;     // Not running on tcmalloc
+  }
+  const size_t size = 768 << 20;
+  char* p = reinterpret_cast<char*>(malloc(size));
+  if (p == NULL) return;        // Not enough address space; skip
+  CHECK(mi->GetNumericProperty("tcmalloc.pagemap_bytes", &mapped));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_released_bytes",
+                               &heap_released));
+  free(p);
+  CHECK(mi->GetNumericProperty("tcmalloc.pagemap_bytes", &released));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_released_bytes",
+                               &heap_released_after));
+  CHECK(released <= mapped);
+  if (released < mapped) {
+    // The memory under the dropped leaves went back to the system too
+    CHECK(heap_released_after > heap_released);
+  }
+  if (page_size <= 8192) {
+    // The block covers at least one whole leaf of any of the maps
+    CHECK(released < mapped);
+  }
+
+  p = reinterpret_cast<char*>(malloc(size));
+  CHECK(p != NULL);
+  for (size_t i = 0; i < size; i += size / 16) p[i] = 1;
+  free(p);
+}
+
+// The number of size classes, and with TCMALLOC_SIZE_CLASSES set,
+// whether the custom classes were taken.
+static void TestSizeClasses() {
+  size_t classes;
+  if (!MallocInterface::instance()->GetNumericProperty("tcmalloc.size_classes",
+                                                       &classes)) {
+    return;     // Not running on tcmalloc
+  }
+  CHECK(classes > 0);
+  const char* list = getenv("TCMALLOC_SIZE_CLASSES");
+  if (list != NULL) {
+    // One class per size, plus the biggest one if it is not listed
+    size_t n = 0;
+    for (const char* p = list; *p != '\0'; p++) {
+      if (isdigit(*p) && (p == list || !isdigit(p[-1]))) n++;
+    }
+    CHECK(classes == n || classes == n + 1);
+  }
+  for (size_t size = 1; size <= (300 << 10); size += size / 8 + 1) {
+    char* p = reinterpret_cast<char*>(malloc(size));
+    CHECK(p != NULL);
+    memset(p, 0x5a, size);
+    free(p);
+  }
+}
+
+// Count of the size histogram bucket whose largest size is "size"
+static unsigned long long HistogramCount(const char* histogram, size_t size) {
+  for (const char* line = histogram; line != NULL; ) {
+    unsigned long bucket;
+    unsigned long long count;
+    if (line[0] != '#' &&
+        sscanf(line, "%lu %llu", &bucket, &count) == 2 && bucket == size) {
+      return count;
+    }
+    line = strchr(line, '\n');
+    if (line != NULL) line++;
+  }
+  return 0;
+}
+
+// Allocations are counted in the size histogram while it is enabled
+static void TestSizeHistogram() {
+  MallocInterface* mi = MallocInterface::instance();
+  if (!mi->SetNumericProperty("tcmalloc.size_histogram", 0) ||
+      !mi->SetNumericProperty("tcmalloc.size_histogram", 1)) {
+    return;     // Not running on tcmalloc
+  }
+  static const int kSmall = 10;
+  static const int kLarge = 3;
+  void* p[kSmall + kLarge];
+  for (int i = 0; i < kSmall; i++) p[i] = malloc(1000);
+  for (int i = 0; i < kLarge; i++) p[kSmall + i] = malloc(600 << 10);
+  CHECK(mi->SetNumericProperty("tcmalloc.size_histogram", 0));
+  for (int i = 0; i < kSmall + kLarge; i++) free(p[i]);
+
+  static char buffer[256 << 10];
+  mi->GetSizeHistogram(buffer, sizeof(buffer));
+  CHECK(HistogramCount(buffer, 1000) >= kSmall);
+  CHECK(HistogramCount(buffer, 1 << 20) >= kLarge);   // Powers of two
+
+  // Enabling it again starts from scratch
+  CHECK(mi->SetNumericProperty("tcmalloc.size_histogram", 1));
+  CHECK(mi->SetNumericProperty("tcmalloc.size_histogram", 0));
+  mi->GetSizeHistogram(buffer, sizeof(buffer));
+  CHECK(HistogramCount(buffer, 1 << 20) == 0);
+}
+
+// A class that keeps fetching spans gets bigger ones
+static void TestAdaptiveSpanPages() {
+  MallocInterface* mi = MallocInterface::instance();
+  if (!mi->SetNumericProperty("tcmalloc.adaptive_span_pages", 1)) {
+    return;     // Not running on tcmalloc
+  }
+  static const size_t kSize = 3000;
+  static const int kObjects = 4000;
+  void** p = new void*[kObjects];
+  p[0] = malloc(kSize);
+  const size_t before = ObjectsPerSpan(kSize, NULL);
+  CHECK(before > 0);
+  for (int i = 1; i < kObjects; i++) p[i] = malloc(kSize);
+  CHECK(ObjectsPerSpan(kSize, NULL) > before);
+  for (int i = 0; i < kObjects; i++) free(p[i]);
+  delete[] p;
+
+  // With big pages, the smallest class would outgrow the 15-bit count
+  // of objects in use in a span if its spans kept getting bigger
+  static const int kSmallObjects = 1 << 20;
+  p = new void*[kSmallObjects];
+  for (int i = 0; i < kSmallObjects; i++) p[i] = malloc(8);
+  CHECK(ObjectsPerSpan(8, NULL) < (1 << 15));
+  for (int i = 0; i < kSmallObjects; i++) free(p[i]);
+  delete[] p;
+  CHECK(mi->SetNumericProperty("tcmalloc.adaptive_span_pages", 0));
+}
+
+// Number of mappings in this process, or -1 if unknown
+static int CountMappings() {
+  FILE* f = fopen("/proc/self/maps", "r");
+  if (f == NULL) return -1;
+  int lines = 0;
+  for (int c; (c = getc(f)) != EOF; ) {
+    if (c == '\n') lines++;
+  }
+  fclose(f);
+  return lines;
+}
+
+// Earlier tests leave hundreds of MB free in the page heap.  Takes
+// kFillerSize blocks into "fillers" until the heap has to grow for one,
+// so that later allocations of that size or more grow it as well.  The
+// blocks are never touched.  Returns the number of blocks taken.
+static const size_t kFillerSize = 4 << 20;
+static const int kMaxFillers = 1024;
+static int UseUpFreeMemory(char** fillers) {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t heap_size, now;
+  CHECK(mi->GetNumericProperty("generic.heap_size", &heap_size));
+  int used = 0;
+  do {
+    CHECK(used < kMaxFillers);
+    fillers[used] = reinterpret_cast<char*>(malloc(kFillerSize));
+    CHECK(fillers[used] != NULL);
+    used++;
+    CHECK(mi->GetNumericProperty("generic.heap_size", &now));
+  } while (now == heap_size);
+  return used;
+}
+
+// Growing the heap extends the mappings it already has
+static void TestHeapGrowthMappings() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t heap_size;
+  if (!mi->GetNumericProperty("generic.heap_size", &heap_size) ||
+      CountMappings() < 0) {
+    return;     // Not running on tcmalloc, or no /proc
+  }
+  const char* memfs = getenv("TCMALLOC_MEMFS_PATH");
+  if (memfs != NULL && memfs[0] != '\0') {
+    return;     // The file allocator maps every request on its own
+  }
+  static const size_t kBlockSize = kFillerSize;
+  static const int kBlocks = 32;
+
+  static char* fillers[kMaxFillers];
+  const int fillers_used = UseUpFreeMemory(fillers);
+  size_t before_heap;
+  CHECK(mi->GetNumericProperty("generic.heap_size", &before_heap));
+  size_t slack;
+  CHECK(mi->GetNumericProperty("tcmalloc.slack_bytes", &slack));
+  const int before = CountMappings();
+
+  char* p[kBlocks];
+  for (int i = 0; i < kBlocks; i++) {
+    p[i] = reinterpret_cast<char*>(malloc(kBlockSize));
+    CHECK(p[i] != NULL);
+    p[i][0] = 1;
+  }
+  size_t after_heap;
+  CHECK(mi->GetNumericProperty("generic.heap_size", &after_heap));
+  CHECK(after_heap > before_heap);
+  CHECK(after_heap + slack >= before_heap + kBlocks * kBlockSize);
+  // A new reservation may be needed, which unmaps the tail of the last
+  CHECK(CountMappings() <= before + 4);
+  for (int i = 0; i < kBlocks; i++) free(p[i]);
+  for (int i = 0; i < fillers_used; i++) free(fillers[i]);
+}
+
+// Passes requests on to the allocator it replaced unless told to fail
+class FailingSysAllocator : public SysAllocator {
+ public:
+  explicit FailingSysAllocator(SysAllocator* next)
+      : next_(next), fail_(false), calls_(0) { }
+
+  virtual void* Alloc(size_t size, size_t alignment) {
+    calls_++;
+    return fail_ ? NULL : next_->Alloc(size, alignment);
+  }
+
+  virtual bool Release(void* start, size_t length) {
+    return next_->Release(start, length);
+  }
+
+  SysAllocator* next_;
+  bool fail_;
+  int calls_;
+};
+
+// The heap grows through the installed system allocator
+static void TestSystemAllocator() {
+  MallocInterface* mi = MallocInterface::instance();
+  SysAllocator* previous = mi->GetSystemAllocator();
+  if (previous == NULL) return;     // Not supported
+  static FailingSysAllocator failing(previous);
+  CHECK(mi->SetSystemAllocator(&failing));
+
+  // Bigger than anything the heap has free
+  const size_t kHuge = static_cast<size_t>(1) << (sizeof(void*) == 8 ? 34 : 30);
+  failing.fail_ = true;
+  void* p = malloc(kHuge);
+  CHECK(p == NULL);
+  CHECK(failing.calls_ > 0);
+  failing.fail_ = false;
+
+  CHECK(mi->SetSystemAllocator(previous));
+  CHECK(mi->GetSystemAllocator() == previous);
+  p = malloc(4 << 20);
+  CHECK(p != NULL);
+  free(p);
+}
+
+// Bytes of the (unlinked) file that TCMALLOC_MEMFS_PATH "memfs" put the
+// heap in that are backed by storage, or -1 if it is not found
+static long long MemFileBytes(const char* memfs) {
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir == NULL) return -1;
+  long long bytes = -1;
+  for (struct dirent* e; bytes < 0 && (e = readdir(dir)) != NULL; ) {
+    char path[sizeof("/proc/self/fd/") + NAME_MAX];
+    char target[4096];
+    snprintf(path, sizeof(path), "/proc/self/fd/%s", e->d_name);
+    const ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len <= 0) continue;
+    target[len] = '\0';
+    struct stat st;
+    if ((strstr(target, "memfd:tcmalloc") != NULL ||
+         strncmp(target, memfs, strlen(memfs)) == 0) &&
+        stat(path, &st) == 0) {
+      bytes = static_cast<long long>(st.st_blocks) * 512;
+    }
+  }
+  closedir(dir);
+  return bytes;
+}
+
+// Memory given back from a heap in a file leaves the file as well
+static void TestFileMemoryRelease() {
+  const char* memfs = getenv("TCMALLOC_MEMFS_PATH");
+  if (memfs == NULL || memfs[0] == '\0') return;
+  static const size_t kSize = 64 << 20;
+  // Stored in a volatile so that the compiler cannot drop the block
+  static char* volatile p;
+  p = reinterpret_cast<char*>(malloc(kSize));
+  CHECK(p != NULL);
+  memset(p, 1, kSize);
+  const long long used = MemFileBytes(memfs);
+  if (used < 0) {
+    free(p);
+    return;     // Not found
+  }
+  CHECK(used >= static_cast<long long>(kSize));
+  free(p);
+  MallocInterface::instance()->ReleaseFreeMemory();
+  CHECK(MemFileBytes(memfs) <= used - static_cast<long long>(kSize));
+}
+
+// Free objects in the central and thread caches of the smallest size
+// class listed in the stats that holds "size"-byte objects, whose size
+// goes to "*class_size", or 0 if there is none
+static unsigned long long FreeObjects(size_t size, size_t* class_size) {
+  static char buffer[64 << 10];
+  MallocInterface::instance()->GetStats(buffer, sizeof(buffer));
+  for (const char* line = strstr(buffer, "class "); line != NULL;
+       line = strstr(line + 1, "\nclass ")) {
+    if (line[0] == '\n') line++;
+    int cl;
+    unsigned long bytes;
+    unsigned long long objects;
+    if (sscanf(line, "class %d [ %lu bytes ] : %llu objs",
+               &cl, &bytes, &objects) == 3 && bytes >= size) {
+      *class_size = bytes;
+      return objects;
+    }
+  }
+  *class_size = 0;
+  return 0;
+}
+
+// Warming up the heap grows it, and warming up a size class fills its
+// cache
+static void TestWarmUp() {
+  MallocInterface* mi = MallocInterface::instance();
+  if (!mi->PrefaultHeap(0)) return;     // Not supported
+  static const size_t kPrefault = 64 << 20;
+
+  // No free span is big enough once the fillers are taken
+  static char* fillers[kMaxFillers];
+  const int fillers_used = UseUpFreeMemory(fillers);
+  size_t before, after, free_bytes, released, released_after;
+  CHECK(mi->GetNumericProperty("generic.heap_size", &before));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_released_bytes",
+                               &released));
+  CHECK(mi->PrefaultHeap(kPrefault));
+  CHECK(mi->GetNumericProperty("generic.heap_size", &after));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_released_bytes",
+                               &released_after));
+  CHECK(after > before);
+  // The touched pages are not given back again
+  CHECK(released_after <= released);
+  CHECK(mi->GetNumericProperty("tcmalloc.slack_bytes", &free_bytes));
+  CHECK(free_bytes >= kPrefault);
+  for (int i = 0; i < fillers_used; i++) free(fillers[i]);
+
+  // The size of the objects is not used anywhere else.  A thread cache
+  // keeps at least this many objects of a class.
+  static const size_t kSize = 1500;
+  static const int kObjects = 200;
+  size_t class_size, populated_class;
+  const unsigned long long free_before = FreeObjects(kSize, &class_size);
+  CHECK(mi->PopulateSizeClass(kSize, kObjects));
+  const unsigned long long free_after = FreeObjects(kSize, &populated_class);
+  CHECK(free_after >= kObjects);
+  // The class was not listed before if a bigger one was found then
+  if (class_size == populated_class && free_before < kObjects) {
+    CHECK(free_after > free_before);
+  }
+  // Large counts are capped
+  static const int kTooMany = 100000;
+  CHECK(mi->PopulateSizeClass(kSize, kTooMany));
+  CHECK(FreeObjects(kSize, &populated_class) < kTooMany);
+  CHECK(!mi->PopulateSizeClass(1 << 30, 1));
+  void* p = malloc(kSize);
+  CHECK(p != NULL);
+  free(p);
+}
+
+// The "VmFlags" line of the /proc/self/smaps entry that maps "p", or
+// the empty string if there is none
+static const char* MappingFlags(const void* p) {
+  static char flags[512];
+  flags[0] = '\0';
+  FILE* f = fopen("/proc/self/smaps", "r");
+  if (f == NULL) return flags;
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+  bool inside = false;
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned long start, end;
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+      inside = (start <= addr && addr < end);
+    } else if (inside && strncmp(line, "VmFlags:", 8) == 0) {
+      strcpy(flags, line);
+      break;
+    }
+  }
+  fclose(f);
+  return flags;
+}
+
+// New heap memory gets the transparent huge page advice asked for
+static void TestHugePageAdvice() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t before, after;
+  if (!mi->GetNumericProperty("tcmalloc.huge_page_bytes", &before)) {
+    return;     // Not running on tcmalloc
+  }
+  // Kernels without transparent huge pages reject the advice
+  if (access("/sys/kernel/mm/transparent_hugepage/enabled", F_OK) != 0) {
+    return;
+  }
+  static const size_t kSize = 16 << 20;
+  static const char* const kFlag[] = { NULL, " hg", " nh" };
+  static char* fillers[kMaxFillers];
+  for (int advice = 1; advice <= 2; advice++) {
+    const char* property = (advice == 1) ? "tcmalloc.huge_page_bytes"
+                                         : "tcmalloc.no_huge_page_bytes";
+    // Without a free span this big, the block below grows the heap
+    const int fillers_used = UseUpFreeMemory(fillers);
+    CHECK(mi->GetNumericProperty(property, &before));
+    CHECK(mi->SetNumericProperty("tcmalloc.heap_huge_pages", advice));
+    char* p = reinterpret_cast<char*>(malloc(kSize));
+    CHECK(mi->SetNumericProperty("tcmalloc.heap_huge_pages", 0));
+    CHECK(p != NULL);
+    CHECK(mi->GetNumericProperty(property, &after));
+    CHECK(after >= before + kSize);
+    // The start of the block may lie in memory the heap had before
+    const char* flags = MappingFlags(p + kSize - 1);
+    if (flags[0] != '\0') CHECK(strstr(flags, kFlag[advice]) != NULL);
+    free(p);
+    for (int i = 0; i < fillers_used; i++) free(fillers[i]);
+  }
+  CHECK(!mi->SetNumericProperty("tcmalloc.heap_huge_pages", 3));
+}
+
+// The new_handler below lifts the hard limit that made new fail
+static int new_handler_calls = 0;
+
+static void LiftHeapLimit() {
+  new_handler_calls++;
+  CHECK(MallocInterface::instance()->SetNumericProperty(
+            "tcmalloc.heap_hard_limit", 0));
+}
+
+// Growing past the soft limit flushes caches first; the hard limit
+// makes allocations fail
+static void TestHeapLimits() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t heap_size, released, cache_bytes, before, after;
+  if (!mi->GetNumericProperty("tcmalloc.soft_limit_hits", &before)) {
+    return;     // Not running on tcmalloc
+  }
+  static const size_t kBlockSize = 32 << 20;
+  static const size_t kNeeded = 8 << 20;
+
+  // Leave something in our thread cache
+  void* volatile small[64];
+  for (int i = 0; i < 64; i++) small[i] = malloc(100);
+  for (int i = 0; i < 64; i++) free(small[i]);
+
+  // Every block below has to grow the heap.  Every other filler goes
+  // back, which leaves free spans that are smaller than a block.
+  static char* fillers[kMaxFillers];
+  const int fillers_used = UseUpFreeMemory(fillers);
+  CHECK(fillers_used >= 8);
+  for (int i = 0; i < 8; i += 2) free(fillers[i]);
+
+  // Growing past the soft limit by kNeeded gives back that much of the
+  // free page heap memory, which is enough, so caches are left alone
+  CHECK(mi->GetNumericProperty("generic.heap_size", &heap_size));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_released_bytes",
+                               &released));
+  CHECK(mi->SetNumericProperty("tcmalloc.heap_soft_limit",
+                               heap_size - released + kBlockSize - kNeeded));
+  void* p = malloc(kBlockSize);
+  CHECK(mi->SetNumericProperty("tcmalloc.heap_soft_limit", 0));
+  CHECK(p != NULL);
+  CHECK(mi->GetNumericProperty("tcmalloc.soft_limit_hits", &after));
+  CHECK(after == before + 1);
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_released_bytes", &after));
+  CHECK(after >= released + kNeeded);
+  CHECK(mi->GetNumericProperty("tcmalloc.current_total_thread_cache_bytes",
+                               &cache_bytes));
+  CHECK(cache_bytes > 0);
+
+  // Memory given back does not count against the limit, so the heap
+  // grows by a block below it without making room
+  CHECK(mi->GetNumericProperty("tcmalloc.soft_limit_hits", &before));
+  CHECK(mi->GetNumericProperty("generic.heap_size", &heap_size));
+  CHECK(mi->GetNumericProperty("tcmalloc.pageheap_released_bytes",
+                               &released));
+  CHECK(mi->SetNumericProperty("tcmalloc.heap_soft_limit",
+                               heap_size - released + kBlockSize));
+  void* q = malloc(kBlockSize);
+  CHECK(mi->SetNumericProperty("tcmalloc.heap_soft_limit", 0));
+  CHECK(q != NULL);
+  CHECK(mi->GetNumericProperty("generic.heap_size", &after));
+  CHECK(after >= heap_size + kBlockSize);
+  CHECK(mi->GetNumericProperty("tcmalloc.soft_limit_hits", &after));
+  CHECK(after == before);
+
+  // When giving back free memory is not enough, caches go as well
+  CHECK(mi->SetNumericProperty("tcmalloc.heap_soft_limit", 1));
+  void* r = malloc(kBlockSize);
+  CHECK(mi->SetNumericProperty("tcmalloc.heap_soft_limit", 0));
+  CHECK(r != NULL);
+  CHECK(mi->GetNumericProperty("tcmalloc.soft_limit_hits", &after));
+  CHECK(after == before + 1);
+  CHECK(mi->GetNumericProperty("tcmalloc.current_total_thread_cache_bytes",
+                               &cache_bytes));
+  CHECK(cache_bytes == 0);
+
+  // The hard limit keeps the heap from growing by a block
+  CHECK(mi->GetNumericProperty("generic.heap_size", &heap_size));
+  CHECK(mi->GetNumericProperty("tcmalloc.hard_limit_hits", &before));
+  CHECK(mi->SetNumericProperty("tcmalloc.heap_hard_limit",
+                               heap_size + kBlockSize / 2));
+  CHECK(malloc(kBlockSize) == NULL);
+  CHECK(mi->GetNumericProperty("tcmalloc.hard_limit_hits", &after));
+  CHECK(after > before);
+
+  // operator new keeps calling the new_handler while it fails
+  std::new_handler old_handler = std::set_new_handler(LiftHeapLimit);
+  char* s = new char[kBlockSize];
+  std::set_new_handler(old_handler);
+  CHECK(new_handler_calls == 1);
+  CHECK(mi->GetNumericProperty("tcmalloc.heap_hard_limit", &after));
+  CHECK(after == 0);
+
+  delete[] s;
+  free(r);
+  free(q);
+  free(p);
+  for (int i = 1; i < 8; i += 2) free(fillers[i]);
+  for (int i = 8; i < fillers_used; i++) free(fillers[i]);
+}
+
+// Threads that grow the heap at the same time get disjoint memory
+static const int kGrowthThreads = 4;
+static const int kGrowthBlocks = 16;
+
+static void* GrowthThread(void* arg) {
+  const int id = reinterpret_cast<uintptr_t>(arg);
+  const size_t size = (1 << 20) + id * 4096;
+  char* p[kGrowthBlocks];
+  for (int i = 0; i < kGrowthBlocks; i++) {
+    p[i] = reinterpret_cast<char*>(malloc(size));
+    CHECK(p[i] != NULL);
+    memset(p[i], id, size);
+  }
+  for (int i = 0; i < kGrowthBlocks; i++) {
+    for (size_t j = 0; j < size; j += 4096) CHECK(p[i][j] == id);
+    CHECK(p[i][size - 1] == id);
+    free(p[i]);
+  }
+  return NULL;
+}
+
+static void TestConcurrentGrowth() {
+  MallocInterface* mi = MallocInterface::instance();
+  size_t shards;
+  if (!mi->GetNumericProperty("tcmalloc.pageheap_shards", &shards)) {
+    return;     // Not running on tcmalloc
+  }
+  // Separate partitions grow without a page heap lock in common
+  CHECK(mi->SetNumericProperty("tcmalloc.pageheap_shards", kGrowthThreads));
+  pthread_t threads[kGrowthThreads];
+  for (int i = 0; i < kGrowthThreads; i++) {
+    pthread_create(&threads[i], NULL, GrowthThread,
+                   reinterpret_cast<void*>(static_cast<uintptr_t>(i + 1)));
+  }
+  for (int i = 0; i < kGrowthThreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  CHECK(mi->SetNumericProperty("tcmalloc.pageheap_shards", shards));
+}
+
 int main(int argc, char **argv) {
 
   
@@ -53,6 +1023,26 @@ int main(int argc, char **argv) {
   free(buf1);
   delete[] buf2;
 
+  TestNumaPartitions();
+  TestLargeSpanReuse();
+  TestAddressOrderedAllocation();
+  TestDeferredCoalescing();
+  TestReleaseSpanPages();
+  TestPageHeapTrace();
+  TestFragmentationReport();
+  TestPageSize();
+  TestPageMapRelease();
+  TestSizeClasses();
+  TestSizeHistogram();
+  TestAdaptiveSpanPages();
+  TestHeapGrowthMappings();
+  TestSystemAllocator();
+  TestFileMemoryRelease();
+  TestWarmUp();
+  TestHugePageAdvice();
+  TestConcurrentGrowth();
+  TestHeapLimits();
+
   char buffer[10 << 10];
   MallocInterface::instance()->GetStats(buffer, sizeof(buffer));
   printf("Malloc stats:\n%s\n", buffer);